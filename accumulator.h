@@ -0,0 +1,120 @@
+#ifndef ACCUMULATOR_H
+#define ACCUMULATOR_H
+
+#include <algorithm>
+#include <cassert>
+#include <cmath>
+#include <cstdint>
+#include <limits>
+#include <vector>
+
+
+// One-pass statistics of a sample: count, mean, central moments M2..M4,
+// minimum, maximum and an optional fixed-bin histogram. Two accumulators
+// merge into the accumulator of the combined sample (Chan et al., Pebay),
+// so partial results of threads, shards or resumed runs can be reduced
+// without keeping the samples. Merging is exact up to rounding; the
+// rounding depends on the merge order.
+class Accumulator
+{
+public:
+  // Count the samples in nbins bins of equal width over [lo, hi). Samples
+  // outside the range are counted in underflow() and overflow().
+  void set_histogram(double lo, double hi, size_t nbins) {
+    hist_lo = lo;
+    hist_hi = hi;
+    hist.assign(nbins + 2, 0);
+  }
+
+  void add(double x) {
+    Accumulator one;
+    one.n = 1;
+    one.mu = x;
+    one.lo = one.hi = x;
+    merge(one);
+    if (!hist.empty()) hist[bin(x)]++;
+  }
+
+  void merge(const Accumulator &o) {
+    if (o.n == 0) return;
+    if (!o.hist.empty()) {
+      if (hist.empty()) set_histogram(o.hist_lo, o.hist_hi, o.hist.size() - 2);
+      assert(hist.size() == o.hist.size() && hist_lo == o.hist_lo && hist_hi == o.hist_hi);
+      for (size_t b = 0; b < hist.size(); ++b) hist[b] += o.hist[b];
+    }
+    if (n == 0) {
+      n = o.n;
+      mu = o.mu;
+      m2 = o.m2;
+      m3 = o.m3;
+      m4 = o.m4;
+      lo = o.lo;
+      hi = o.hi;
+      return;
+    }
+    double na = n, nb = o.n, N = na + nb;
+    double d = o.mu - mu, dn = d / N;
+    double m2_new = m2 + o.m2 + d*dn*na*nb;
+    double m3_new = m3 + o.m3 + d*dn*dn*na*nb*(na - nb) + 3.0*dn*(na*o.m2 - nb*m2);
+    m4 = m4 + o.m4 + d*dn*dn*dn*na*nb*(na*na - na*nb + nb*nb)
+      + 6.0*dn*dn*(na*na*o.m2 + nb*nb*m2) + 4.0*dn*(na*o.m3 - nb*m3);
+    m3 = m3_new;
+    m2 = m2_new;
+    mu += dn*nb;
+    n += o.n;
+    lo = std::min(lo, o.lo);
+    hi = std::max(hi, o.hi);
+  }
+
+  uint64_t count() const { return n; }
+  double mean() const { return n ? mu : 0.0; }
+  double min() const { return lo; }
+  double max() const { return hi; }
+  // Unbiased sample variance and standard deviation
+  double variance() const { return n > 1 ? m2 / (double)(n - 1) : 0.0; }
+  double std() const { return std::sqrt(variance()); }
+  // Standard error of the mean
+  double sem() const { return n > 0 ? std() / std::sqrt((double)n) : 0.0; }
+  double skewness() const { return m2 > 0 ? std::sqrt((double)n)*m3 / std::pow(m2, 1.5) : 0.0; }
+  // Excess kurtosis
+  double kurtosis() const { return m2 > 0 ? (double)n*m4 / (m2*m2) - 3.0 : 0.0; }
+
+  size_t num_bins() const { return hist.empty() ? 0 : hist.size() - 2; }
+  uint64_t bin_count(size_t b) const { return hist[b + 1]; }
+  uint64_t underflow() const { return hist.empty() ? 0 : hist.front(); }
+  uint64_t overflow() const { return hist.empty() ? 0 : hist.back(); }
+
+  // Raw state, e.g. for partial result files
+  struct State
+  {
+    uint64_t n;
+    double mean, m2, m3, m4, min, max;
+  };
+  State state() const { return {n, mu, m2, m3, m4, lo, hi}; }
+  void set_state(const State &s) {
+    n = s.n;
+    mu = s.mean;
+    m2 = s.m2;
+    m3 = s.m3;
+    m4 = s.m4;
+    lo = s.min;
+    hi = s.max;
+  }
+
+private:
+  size_t bin(double x) const {
+    if (x < hist_lo) return 0;
+    if (x >= hist_hi) return hist.size() - 1;
+    size_t b = 1 + (size_t)((x - hist_lo) / (hist_hi - hist_lo) * (double)(hist.size() - 2));
+    return std::min(b, hist.size() - 2);
+  }
+
+  uint64_t n = 0;
+  double mu = 0.0, m2 = 0.0, m3 = 0.0, m4 = 0.0;
+  double lo = std::numeric_limits<double>::infinity();
+  double hi = -std::numeric_limits<double>::infinity();
+  double hist_lo = 0.0, hist_hi = 0.0;
+  std::vector<uint64_t> hist;
+};
+
+#endif
@@ -0,0 +1,67 @@
+#include <atomic>
+#include <cstdlib>
+#include <iostream>
+#include <new>
+#include <vector>
+
+#include "grid.h"
+
+using namespace std;
+
+// Count every allocation of the process, including those of the grid threads
+static atomic<size_t> allocations(0);
+
+void* operator new(size_t n)
+{
+  allocations++;
+  void *p = malloc(n > 0 ? n : 1);
+  if (!p) throw bad_alloc();
+  return p;
+}
+void operator delete(void *p) noexcept { free(p); }
+void operator delete(void *p, size_t) noexcept { free(p); }
+
+// Once a grid has been built a few times, rebuilding and projecting it
+// must not allocate, whatever the engine, layout, type and threads.
+int main()
+{
+  const size_t WARM = 3, BUILDS = 20;
+  int failed = 0;
+  for (int e = 0; e < 2; ++e)
+    for (int l = 0; l < 2; ++l)
+      for (int t = 0; t < 2; ++t)
+        for (size_t threads : {1, 4}) {
+          Grid::Dimensions dim = {64, 64, 8};
+          Grid grid(0.4, dim, (Grid::GridType)t, 1);
+          grid.set_labeling_engine((Grid::LabelingEngine)e);
+          grid.set_layout((Grid::Layout)l);
+          grid.set_threads(threads);
+          vector<double> occupancy(dim.area()), spins(dim.area());
+          vector<size_t> top(dim.area());
+          Grid::Projection out;
+          out.grid = occupancy.data();
+          out.domains = top.data();
+          out.spins = spins.data();
+
+          for (size_t k = 0; k < WARM; ++k) {
+            grid.set_stream(k);
+            grid.build();
+            grid.domains();
+            grid.project(out);
+          }
+          size_t before = allocations;
+          for (size_t k = 0; k < BUILDS; ++k) {
+            grid.set_stream(WARM + k);
+            grid.build(0.4);
+            grid.domains();
+            grid.project(out);
+          }
+          size_t n = allocations - before;
+          if (n > 0) {
+            cerr << "engine " << e << ", layout " << l << ", type " << t << ", " << threads
+                 << " threads: " << n << " allocations in " << BUILDS << " builds" << endl;
+            failed = 1;
+          }
+        }
+  return failed;
+}
@@ -0,0 +1,56 @@
+#include <algorithm>
+#include "bitlattice.h"
+
+#if defined(__x86_64__) && (defined(__GNUC__) || defined(__clang__))
+#define BITLATTICE_AVX2
+#include <immintrin.h>
+#endif
+
+using namespace std;
+
+
+#ifdef BITLATTICE_AVX2
+static bool have_avx2()
+{
+  static const bool avx2 = __builtin_cpu_supports("avx2") && __builtin_cpu_supports("popcnt");
+  return avx2;
+}
+
+// Popcount with a nibble lookup table (Mula, Kurz, Lemire)
+__attribute__((target("avx2,popcnt")))
+static size_t popcount_avx2(const BitLattice::Word *w, size_t num)
+{
+  const __m256i lookup = _mm256_setr_epi8(0,1,1,2,1,2,2,3,1,2,2,3,2,3,3,4,
+                                          0,1,1,2,1,2,2,3,1,2,2,3,2,3,3,4);
+  const __m256i low_mask = _mm256_set1_epi8(0x0f);
+  __m256i acc = _mm256_setzero_si256();
+  size_t i = 0;
+  for (; i + 4 <= num; i += 4) {
+    __m256i v = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(w + i));
+    __m256i lo = _mm256_and_si256(v, low_mask);
+    __m256i hi = _mm256_and_si256(_mm256_srli_epi16(v, 4), low_mask);
+    __m256i cnt = _mm256_add_epi8(_mm256_shuffle_epi8(lookup, lo),
+                                  _mm256_shuffle_epi8(lookup, hi));
+    acc = _mm256_add_epi64(acc, _mm256_sad_epu8(cnt, _mm256_setzero_si256()));
+  }
+  size_t c = _mm256_extract_epi64(acc, 0) + _mm256_extract_epi64(acc, 1)
+    + _mm256_extract_epi64(acc, 2) + _mm256_extract_epi64(acc, 3);
+  for (; i < num; ++i) c += _mm_popcnt_u64(w[i]);
+  return c;
+}
+#endif
+
+size_t BitLattice::popcount_words(const Word *w, size_t num)
+{
+#ifdef BITLATTICE_AVX2
+  if (num >= 8 && have_avx2()) return popcount_avx2(w, num);
+#endif
+  size_t c = 0;
+  for (size_t i = 0; i < num; ++i) c += __builtin_popcountll(w[i]);
+  return c;
+}
+
+void BitLattice::clear()
+{
+  fill(data.begin(), data.end(), 0);
+}
@@ -0,0 +1,75 @@
+#ifndef BITLATTICE_H
+#define BITLATTICE_H
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+
+// Occupancy field with one bit per cell, packed into 64-bit words in the
+// order of the linear cell index. Since z is the fastest running coordinate,
+// every lattice column is a contiguous range of bits.
+class BitLattice
+{
+public:
+  typedef uint64_t Word;
+  static const size_t WORD_BITS = 64;
+
+  explicit BitLattice(size_t n = 0) : n(n), data((n + WORD_BITS - 1) / WORD_BITS, 0) {}
+
+  size_t size() const { return n; }
+  size_t num_words() const { return data.size(); }
+  const Word* words() const { return data.data(); }
+  Word* words() { return data.data(); }
+
+  bool operator[](size_t i) const { return (data[i / WORD_BITS] >> (i % WORD_BITS)) & 1; }
+  void set(size_t i) { data[i / WORD_BITS] |= Word(1) << (i % WORD_BITS); }
+  void reset(size_t i) { data[i / WORD_BITS] &= ~(Word(1) << (i % WORD_BITS)); }
+  // Clear all bits
+  void clear();
+
+  // Number of set bits in total and in the range [first, last)
+  size_t count() const { return popcount_words(data.data(), data.size()); }
+  size_t count(size_t first, size_t last) const;
+
+  // Index of the first set (clear) bit at or after i, or size() if there is
+  // none. Together they give the runs of occupied cells along z.
+  size_t find_next(size_t i) const { return find(i, 0); }
+  size_t find_next_clear(size_t i) const { return find(i, ~Word(0)); }
+
+  // Word kernel. It uses AVX2 if the CPU supports it.
+  static size_t popcount_words(const Word *w, size_t num);
+
+private:
+  size_t find(size_t i, Word flip) const;
+
+  size_t n;
+  std::vector<Word> data;
+};
+
+inline size_t BitLattice::count(size_t first, size_t last) const
+{
+  if (first >= last) return 0;
+  size_t wf = first / WORD_BITS, wl = (last - 1) / WORD_BITS;
+  Word mask_first = ~Word(0) << (first % WORD_BITS);
+  Word mask_last = ~Word(0) >> (WORD_BITS - 1 - (last - 1) % WORD_BITS);
+  if (wf == wl) return __builtin_popcountll(data[wf] & mask_first & mask_last);
+  return __builtin_popcountll(data[wf] & mask_first)
+    + popcount_words(data.data() + wf + 1, wl - wf - 1)
+    + __builtin_popcountll(data[wl] & mask_last);
+}
+
+inline size_t BitLattice::find(size_t i, Word flip) const
+{
+  if (i >= n) return n;
+  size_t w = i / WORD_BITS;
+  Word bits = (data[w] ^ flip) & (~Word(0) << (i % WORD_BITS));
+  while (bits == 0) {
+    if (++w == data.size()) return n;
+    bits = data[w] ^ flip;
+  }
+  size_t j = w * WORD_BITS + __builtin_ctzll(bits);
+  return j < n ? j : n;
+}
+
+#endif
@@ -0,0 +1,110 @@
+#ifndef CLUSTERSTATS_H
+#define CLUSTERSTATS_H
+
+#include <algorithm>
+#include <cstdint>
+#include <utility>
+
+
+// Size statistics of the domains of a labeling, kept up to date while the
+// domains are created, grow and merge: the number of domains, the number
+// of domains per logarithmic size bin, the sum of the sizes and of their
+// squares, and the largest and second largest domain.
+//
+// All queries are O(1). The only exception is the second largest domain
+// after the largest domain merged with a domain of the second largest size:
+// then it is unknown until set_second_largest() is called with a value that
+// the owner recomputed from all domain sizes.
+class ClusterStats
+{
+public:
+  // Bin b counts the domains of size [2^b, 2^(b+1)). The last bin also
+  // counts all bigger domains.
+  static const int NUM_BINS = 40;
+  static int bin(uint64_t s) {
+    return std::min(63 - __builtin_clzll(s), NUM_BINS - 1);
+  }
+
+  void clear() { *this = ClusterStats(); }
+
+  // A new domain of size s
+  void add(uint64_t s) {
+    num++;
+    total += s;
+    squares += (unsigned __int128)s*s;
+    bins[bin(s)]++;
+    if (s > top) {
+      second = top;
+      second_known = true;
+      top = s;
+    } else if (second_known && s > second) {
+      second = s;
+    }
+  }
+  // The domains of sizes a and b merge, in either order
+  void merge(uint64_t a, uint64_t b) {
+    // The smaller domain is absorbed, so merging into the largest domain
+    // keeps the second largest known
+    if (a < b) std::swap(a, b);
+    num--;
+    total -= b;
+    bins[bin(b)]--;
+    squares -= (unsigned __int128)b*b;
+    replace(a, a + b, b);
+  }
+  // The domain of size s gets one more cell
+  void grow(uint64_t s) { replace(s, s + 1, 0); }
+
+  uint64_t count() const { return num; }
+  // Number of cells in all domains
+  uint64_t cells() const { return total; }
+  uint64_t bin_count(int b) const { return bins[b]; }
+  uint64_t largest() const { return top; }
+  bool is_second_known() const { return second_known; }
+  uint64_t second_largest() const { return second; }
+  void set_second_largest(uint64_t s) {
+    second = s;
+    second_known = true;
+  }
+  // Sum of the squared sizes of all domains but the largest one
+  double second_moment() const {
+    return num > 0 ? (double)(squares - (unsigned __int128)top*top) : 0.0;
+  }
+  // Mean size of the domain of an occupied cell without the largest domain,
+  // the percolation susceptibility
+  double susceptibility() const { return total > 0 ? second_moment() / (double)total : 0.0; }
+
+private:
+  // A domain of size s becomes one of size n > s, after absorbing the
+  // domain of size absorbed, if any
+  void replace(uint64_t s, uint64_t n, uint64_t absorbed) {
+    total += n - s;
+    squares += (unsigned __int128)n*n - (unsigned __int128)s*s;
+    bins[bin(s)]--;
+    bins[bin(n)]++;
+    if (n > top) {
+      if (s == top) {
+        // The largest domain grew. The second largest is still there
+        // unless it was absorbed.
+        second_known = second_known && (absorbed == 0 || absorbed < second);
+      } else {
+        // The old largest domain is now second unless it was absorbed
+        second_known = absorbed != top;
+        second = top;
+      }
+      top = n;
+    } else if (second_known && n > second) {
+      second = n;
+    }
+  }
+
+  uint64_t num = 0;
+  uint64_t total = 0;
+  unsigned __int128 squares = 0;
+  uint64_t bins[NUM_BINS] = {0};
+  uint64_t top = 0;
+  uint64_t second = 0;
+  bool second_known = true;
+};
+
+#endif
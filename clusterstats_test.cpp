@@ -0,0 +1,89 @@
+#include <algorithm>
+#include <iostream>
+#include <string>
+#include <vector>
+
+#include "clusterstats.h"
+#include "philox.h"
+
+using namespace std;
+
+static int failures = 0;
+
+static void check(bool ok, const string &what)
+{
+  if (ok) return;
+  if (failures < 20) cerr << what << endl;
+  failures++;
+}
+
+// Largest and second largest of the sizes
+static pair<uint64_t, uint64_t> top_two(vector<uint64_t> sizes)
+{
+  sort(sizes.rbegin(), sizes.rend());
+  sizes.resize(max<size_t>(sizes.size(), 2), 0);
+  return {sizes[0], sizes[1]};
+}
+
+int main()
+{
+  // Merging a smaller domain into the largest one, from either side, keeps
+  // the second largest known
+  for (int side = 0; side < 2; ++side) {
+    ClusterStats stats;
+    for (uint64_t s : {10, 7, 3, 2}) stats.add(s);
+    if (side == 0) stats.merge(10, 3);
+    else stats.merge(3, 10);
+    check(stats.largest() == 13 && stats.is_second_known() && stats.second_largest() == 7,
+          "merge into the largest domain, side " + to_string(side));
+    check(stats.count() == 3 && stats.cells() == 22, "merge counts, side " + to_string(side));
+  }
+
+  // Absorbing the second largest makes it unknown, from either side
+  for (int side = 0; side < 2; ++side) {
+    ClusterStats stats;
+    for (uint64_t s : {10, 7, 3}) stats.add(s);
+    if (side == 0) stats.merge(10, 7);
+    else stats.merge(7, 10);
+    check(stats.largest() == 17 && !stats.is_second_known(),
+          "merge of the two largest domains, side " + to_string(side));
+  }
+
+  // Random creations, growths and merges against the sizes themselves. The
+  // second largest must be right whenever it is known, and only merges of
+  // the second largest into the largest may make it unknown.
+  PhiloxEngine rng(1);
+  for (int it = 0; it < 200; ++it) {
+    ClusterStats stats;
+    vector<uint64_t> sizes;
+    for (int step = 0; step < 300; ++step) {
+      uint64_t op = rng.uniform(3);
+      if (op == 0 || sizes.size() < 2) {
+        uint64_t s = 1 + rng.uniform(5);
+        sizes.push_back(s);
+        stats.add(s);
+      } else if (op == 1) {
+        size_t i = rng.uniform(sizes.size());
+        stats.grow(sizes[i]++);
+      } else {
+        size_t i = rng.uniform(sizes.size()), j = rng.uniform(sizes.size() - 1);
+        if (j >= i) j++;
+        auto before = top_two(sizes);
+        bool absorbs_second = min(sizes[i], sizes[j]) == before.second
+          && max(sizes[i], sizes[j]) == before.first;
+        stats.merge(sizes[i], sizes[j]);
+        sizes[i] += sizes[j];
+        sizes.erase(sizes.begin() + j);
+        check(stats.is_second_known() || absorbs_second,
+              "second largest lost after a merge, iteration " + to_string(it));
+      }
+      auto truth = top_two(sizes);
+      check(stats.largest() == truth.first, "largest, iteration " + to_string(it));
+      if (!stats.is_second_known()) stats.set_second_largest(truth.second);
+      check(stats.second_largest() == truth.second, "second largest, iteration " + to_string(it));
+      check(stats.count() == sizes.size(), "count, iteration " + to_string(it));
+    }
+  }
+  if (failures > 0) cerr << failures << " failures" << endl;
+  return failures > 0;
+}
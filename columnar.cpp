@@ -0,0 +1,165 @@
+#include <cstring>
+#include "columnar.h"
+
+using namespace std;
+
+namespace columnar {
+
+static const char MAGIC[8] = {'P', 'E', 'R', 'C', 'C', 'O', 'L', '1'};
+
+struct ChunkHeader
+{
+  char table[16];
+  uint32_t num_columns;
+  uint32_t reserved;
+  uint64_t num_rows;
+};
+
+struct ColumnHeader
+{
+  char name[32];
+  uint32_t type;
+  uint32_t reserved;
+};
+
+
+Writer::Writer(const string &path, size_t chunk_rows)
+  : chunk_rows(chunk_rows)
+{
+  file = fopen(path.c_str(), "wb");
+  if (!file) return;
+  fwrite(MAGIC, 1, sizeof(MAGIC), file);
+  thread = std::thread(&Writer::run, this);
+}
+
+Writer::~Writer()
+{
+  if (!file) return;
+  flush();
+  {
+    lock_guard<mutex> lock(m);
+    stop = true;
+  }
+  cv.notify_one();
+  thread.join();
+  fclose(file);
+}
+
+size_t Writer::add_table(const string &name, const vector<Column> &columns)
+{
+  tables.emplace_back(new Table);
+  Chunk &c = tables.back()->chunk;
+  c.table = name;
+  c.columns = columns;
+  c.data.resize(columns.size());
+  for (auto &col : c.data) col.reserve(chunk_rows);
+  return tables.size() - 1;
+}
+
+void Writer::append(size_t table, const Value *row, size_t n)
+{
+  Table &t = *tables[table];
+  lock_guard<mutex> lock(t.m);
+  for (size_t j = 0; j < n; ++j) t.chunk.data[j].push_back(row[j]);
+  if (++t.chunk.num_rows == chunk_rows) {
+    Chunk next;
+    next.table = t.chunk.table;
+    next.columns = t.chunk.columns;
+    next.data.resize(next.columns.size());
+    for (auto &col : next.data) col.reserve(chunk_rows);
+    swap(next, t.chunk);
+    submit(move(next));
+  }
+}
+
+void Writer::flush()
+{
+  for (auto &t : tables) {
+    lock_guard<mutex> lock(t->m);
+    if (t->chunk.num_rows == 0) continue;
+    Chunk next;
+    next.table = t->chunk.table;
+    next.columns = t->chunk.columns;
+    next.data.resize(next.columns.size());
+    swap(next, t->chunk);
+    submit(move(next));
+  }
+}
+
+void Writer::submit(Chunk &&chunk)
+{
+  {
+    lock_guard<mutex> lock(m);
+    queue.push_back(move(chunk));
+  }
+  cv.notify_one();
+}
+
+void Writer::run()
+{
+  while (true) {
+    Chunk c;
+    {
+      unique_lock<mutex> lock(m);
+      cv.wait(lock, [&] { return stop || !queue.empty(); });
+      if (queue.empty()) break;
+      c = move(queue.front());
+      queue.pop_front();
+    }
+    ChunkHeader h;
+    memset(&h, 0, sizeof(h));
+    strncpy(h.table, c.table.c_str(), sizeof(h.table) - 1);
+    h.num_columns = c.columns.size();
+    h.num_rows = c.num_rows;
+    fwrite(&h, sizeof(h), 1, file);
+    for (auto &col : c.columns) {
+      ColumnHeader ch;
+      memset(&ch, 0, sizeof(ch));
+      strncpy(ch.name, col.name.c_str(), sizeof(ch.name) - 1);
+      ch.type = col.type;
+      fwrite(&ch, sizeof(ch), 1, file);
+    }
+    for (auto &col : c.data) fwrite(col.data(), sizeof(Value), col.size(), file);
+    fflush(file);
+  }
+}
+
+
+Reader::Reader(const string &path)
+{
+  file = fopen(path.c_str(), "rb");
+  char magic[sizeof(MAGIC)];
+  if (file && (fread(magic, 1, sizeof(magic), file) != sizeof(magic)
+               || memcmp(magic, MAGIC, sizeof(MAGIC)) != 0)) {
+    fclose(file);
+    file = nullptr;
+  }
+}
+
+Reader::~Reader()
+{
+  if (file) fclose(file);
+}
+
+bool Reader::next(Chunk &chunk)
+{
+  ChunkHeader h;
+  if (!file || fread(&h, sizeof(h), 1, file) != 1) return false;
+  chunk.table.assign(h.table, strnlen(h.table, sizeof(h.table)));
+  chunk.num_rows = h.num_rows;
+  chunk.columns.resize(h.num_columns);
+  for (auto &col : chunk.columns) {
+    ColumnHeader ch;
+    if (fread(&ch, sizeof(ch), 1, file) != 1) return false;
+    col.name.assign(ch.name, strnlen(ch.name, sizeof(ch.name)));
+    col.type = (Type)ch.type;
+  }
+  chunk.data.resize(h.num_columns);
+  for (auto &col : chunk.data) {
+    col.assign(h.num_rows, Value(0.0));
+    if (fread(col.data(), sizeof(Value), h.num_rows, file) != h.num_rows) return false;
+  }
+  return true;
+}
+
+}
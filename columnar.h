@@ -0,0 +1,116 @@
+#ifndef COLUMNAR_H
+#define COLUMNAR_H
+
+#include <condition_variable>
+#include <cstdint>
+#include <cstdio>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <type_traits>
+#include <vector>
+
+
+// Self-describing chunked columnar file. After the 8 byte magic "PERCCOL1"
+// the file is a sequence of chunks, each with the rows of one table:
+//
+//   char     table[16]      table name, zero padded
+//   uint32   num_columns
+//   uint32   reserved
+//   uint64   num_rows
+//   num_columns x { char name[32]; uint32 type; uint32 reserved; }
+//   num_columns x num_rows x 8 bytes, column by column
+//
+// Every value is a uint64 or a double in native byte order.
+namespace columnar {
+
+enum Type : uint32_t {UINT64 = 1, DOUBLE = 2};
+
+union Value
+{
+  uint64_t u;
+  double f;
+  Value(double f) : f(f) {}
+  template<typename T, typename std::enable_if<std::is_integral<T>::value, int>::type = 0>
+  Value(T u) : u(u) {}
+};
+
+struct Column
+{
+  std::string name;
+  Type type;
+};
+
+struct Chunk
+{
+  std::string table;
+  std::vector<Column> columns;
+  size_t num_rows = 0;
+  // Column major
+  std::vector<std::vector<Value>> data;
+};
+
+// Buffers the rows of every table in chunks and writes full chunks on a
+// background thread, so appending a row never waits for the disk.
+class Writer
+{
+public:
+  explicit Writer(const std::string &path, size_t chunk_rows = 4096);
+  // Writes the remaining rows and closes the file
+  ~Writer();
+  Writer(const Writer&) = delete;
+  Writer& operator=(const Writer&) = delete;
+
+  bool is_open() const { return file != nullptr; }
+  // Declare a table and return its id for append()
+  size_t add_table(const std::string &name, const std::vector<Column> &columns);
+  // Append a row with one value per column. Thread safe.
+  void append(size_t table, std::initializer_list<Value> row) {
+    append(table, row.begin(), row.size());
+  }
+  void append(size_t table, const std::vector<Value> &row) {
+    append(table, row.data(), row.size());
+  }
+  void append(size_t table, const Value *row, size_t n);
+  // Hand all buffered rows to the writer thread
+  void flush();
+
+private:
+  struct Table
+  {
+    std::mutex m;
+    Chunk chunk;
+  };
+  void submit(Chunk &&chunk);
+  void run();
+
+  FILE *file = nullptr;
+  size_t chunk_rows;
+  std::vector<std::unique_ptr<Table>> tables;
+
+  std::mutex m;
+  std::condition_variable cv;
+  std::deque<Chunk> queue;
+  bool stop = false;
+  std::thread thread;
+};
+
+// Reads the chunks of a file one after another
+class Reader
+{
+public:
+  explicit Reader(const std::string &path);
+  ~Reader();
+  bool is_open() const { return file != nullptr; }
+  // Read the next chunk. Returns false at the end of the file or on error.
+  bool next(Chunk &chunk);
+
+private:
+  FILE *file = nullptr;
+};
+
+}
+
+#endif
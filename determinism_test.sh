@@ -0,0 +1,67 @@
+#!/bin/sh
+# Usage: determinism_test.sh SIM
+#
+# The results of sim only depend on the seed: runs on other thread counts,
+# the merged partial results of a sharded run and runs resumed from a
+# checkpoint log, including one cut off in the middle of a record, must
+# print byte-identical CSV rows.
+set -e
+SIM=$1
+DIR=$(mktemp -d)
+trap 'rm -rf "$DIR"' EXIT
+
+check() {
+  NAME=$1
+  WHAT=$2
+  shift 2
+  if ! cmp -s "$DIR/full.csv" "$DIR/$NAME.csv"; then
+    echo "$WHAT differs from the single threaded run: $*" >&2
+    exit 1
+  fi
+}
+
+for ARGS in "--spins 8 --seed 5 10 4 5 150 sc" \
+            "--spins 8 --seed 9 8 4 4 130 hex" \
+            "--sweep --seed 3 10 4 6 100 sc" \
+            "--stream --seed 2 12 3 4 100 hex"; do
+  $SIM --threads 1 $ARGS > "$DIR/full.csv" 2>/dev/null
+
+  $SIM --threads 4 $ARGS > "$DIR/threads.csv" 2>/dev/null
+  check threads "4 threads" $ARGS
+
+  for i in 0 1 2; do
+    $SIM --threads 2 --shard $i/3 --partial "$DIR/part$i" $ARGS > /dev/null 2>&1
+  done
+  $SIM merge "$DIR/part2" "$DIR/part0" "$DIR/part1" > "$DIR/merged.csv" 2>/dev/null
+  check merged "merged shards" $ARGS
+
+  rm -f "$DIR/log"
+  $SIM --threads 3 --checkpoint "$DIR/log" $ARGS > "$DIR/logged.csv" 2>/dev/null
+  check logged "logged run" $ARGS
+  $SIM --threads 3 --checkpoint "$DIR/log" $ARGS > "$DIR/replayed.csv" 2>/dev/null
+  check replayed "run from a complete log" $ARGS
+
+  # A crash leaves part of the log and maybe a partial record behind
+  SIZE=$(wc -c < "$DIR/log")
+  head -c $((SIZE/2 + 7)) "$DIR/log" > "$DIR/cut"
+  mv "$DIR/cut" "$DIR/log"
+  $SIM --threads 3 --checkpoint "$DIR/log" $ARGS > "$DIR/resumed.csv" 2>/dev/null
+  check resumed "resumed run" $ARGS
+  # In sweep mode the log now holds the rerun P steps of a grid twice
+  $SIM --threads 3 --checkpoint "$DIR/log" $ARGS > "$DIR/rereplayed.csv" 2>/dev/null
+  check rereplayed "run from a resumed log" $ARGS
+done
+
+# With a target error the P steps stop at different grid counts, but only
+# depend on the seed
+ARGS="--target-error 0.03 --spins 8 --seed 4 10 4 5 200 sc"
+$SIM --threads 1 $ARGS > "$DIR/full.csv" 2>/dev/null
+$SIM --threads 4 $ARGS > "$DIR/threads.csv" 2>/dev/null
+check threads "4 threads" $ARGS
+rm -f "$DIR/log"
+$SIM --threads 3 --checkpoint "$DIR/log" $ARGS > "$DIR/logged.csv" 2>/dev/null
+SIZE=$(wc -c < "$DIR/log")
+head -c $((SIZE/2 + 7)) "$DIR/log" > "$DIR/cut"
+mv "$DIR/cut" "$DIR/log"
+$SIM --threads 3 --checkpoint "$DIR/log" $ARGS > "$DIR/resumed.csv" 2>/dev/null
+check resumed "resumed run" $ARGS
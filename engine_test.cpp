@@ -0,0 +1,140 @@
+#include <algorithm>
+#include <cmath>
+#include <iostream>
+#include <limits>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include "grid.h"
+#include "streaming.h"
+
+using namespace std;
+
+// A labeling setup of Grid
+struct Engine
+{
+  string name;
+  Grid::LabelingEngine engine;
+  Grid::Layout layout;
+  size_t threads;
+  bool topology;
+};
+
+static const Engine ENGINES[] = {
+  {"bfs", Grid::LABEL_BFS, Grid::LAYOUT_PERIODIC, 1, false},
+  {"union-find", Grid::LABEL_UNION_FIND, Grid::LAYOUT_PERIODIC, 1, false},
+  {"halo", Grid::LABEL_UNION_FIND, Grid::LAYOUT_HALO, 1, false},
+  {"slabs", Grid::LABEL_UNION_FIND, Grid::LAYOUT_PERIODIC, 3, false},
+  {"topology", Grid::LABEL_UNION_FIND, Grid::LAYOUT_PERIODIC, 1, true},
+};
+
+static int failures = 0;
+
+static void check(bool ok, const string &what)
+{
+  if (ok) return;
+  if (failures < 20) cerr << what << endl;
+  failures++;
+}
+
+// Every cell mapped to the smallest cell of its domain, and empty cells to
+// the maximum. Two labelings find the same domains iff these are equal.
+static vector<size_t> partition(const Grid &grid)
+{
+  vector<size_t> p(grid.dimensions().volume(), numeric_limits<size_t>::max());
+  for (auto d : grid.domains()) {
+    size_t first = *min_element(d.begin(), d.end());
+    for (size_t i : d) p[i] = first;
+  }
+  return p;
+}
+
+// A grid with the cells of grid, labeled by occupy() one cell at a time
+static vector<size_t> occupy_partition(const Grid &grid, size_t &domains)
+{
+  Grid g(0.0, grid.dimensions(), grid.type());
+  g.clear();
+  for (auto d : grid.domains())
+    for (size_t i : d) g.occupy(i);
+  domains = g.num_domains();
+  return partition(g);
+}
+
+// Domain count, largest and second largest domain
+static vector<size_t> statistics(const Grid &grid)
+{
+  return {grid.num_domains(), grid.max_domain_len(), grid.second_domain_len()};
+}
+
+// All engines must find the same domains in build() and update(), and the
+// same as occupy() on the same cells. The layer streaming must find the
+// same domains as occupy() on its Bernoulli cells. The hexagonal lattice
+// needs an even Y to be periodic in y, so an odd Y must be rejected.
+int main()
+{
+  for (size_t Y : {1, 3, 7}) {
+    Grid::Dimensions dim = {4, Y, 2};
+    bool grid_rejected = false, streaming_rejected = false;
+    try { Grid g(0.5, dim, Grid::GRID_HEX); } catch (invalid_argument&) { grid_rejected = true; }
+    try { StreamingGrid s(dim, Grid::GRID_HEX); } catch (invalid_argument&) { streaming_rejected = true; }
+    check(grid_rejected && streaming_rejected, "hex with Y=" + to_string(Y) + " accepted");
+  }
+
+  for (int t = 0; t < 2; ++t)
+    for (int it = 0; it < 24; ++it) {
+      Grid::GridType type = t ? Grid::GRID_HEX : Grid::GRID_SC;
+      Grid::Dimensions dim = {size_t(3 + 3*(it%6)), size_t(t ? 4 + 4*(it%3) : 3 + 3*(it%4)),
+                              size_t(1 + 3*(it%4))};
+      double P = 0.1 + 0.035*it;
+      string where = (t ? "hex " : "sc ") + to_string(dim.X) + "x" + to_string(dim.Y) + "x"
+        + to_string(dim.Z) + " P=" + to_string(P);
+
+      vector<size_t> built, built_stats, updated;
+      for (const Engine &e : ENGINES) {
+        Grid g(P, dim, type, it);
+        g.set_labeling_engine(e.engine);
+        g.set_layout(e.layout);
+        g.set_threads(e.threads);
+        g.set_topology(e.topology);
+        g.build();
+        vector<size_t> p = partition(g);
+        if (built.empty()) {
+          built = p;
+          built_stats = statistics(g);
+          size_t domains;
+          check(occupy_partition(g, domains) == p && domains == g.num_domains(),
+                where + ": " + e.name + " build differs from occupy");
+        }
+        check(p == built, where + ": " + e.name + " build differs from bfs");
+        check(statistics(g) == built_stats, where + ": " + e.name + " statistics differ from bfs");
+
+        g.update(min(1.0, P + 0.3));
+        p = partition(g);
+        size_t domains;
+        check(occupy_partition(g, domains) == p && domains == g.num_domains(),
+              where + ": " + e.name + " update differs from occupy");
+        if (updated.empty()) updated = p;
+        check(p == updated, where + ": " + e.name + " update differs from bfs");
+      }
+
+      StreamingGrid s(dim, type);
+      s.generate(P, it, 7);
+      s.run();
+      Grid g(0.0, dim, type);
+      g.clear();
+      uint64_t threshold = (uint64_t)ldexp(P, 64);
+      size_t occupied = 0;
+      for (size_t i = 0; i < dim.volume(); ++i)
+        if (PhiloxEngine::at(it, 7, i) < threshold) {
+          g.occupy(i);
+          occupied++;
+        }
+      check(s.num_occupied() == occupied && s.num_domains() == g.num_domains()
+            && s.max_domain_len() == g.max_domain_len()
+            && s.second_domain_len() == g.second_domain_len(),
+            where + ": streaming differs from occupy");
+    }
+  if (failures > 0) cerr << failures << " mismatches" << endl;
+  return failures > 0;
+}
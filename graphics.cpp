@@ -1,10 +1,10 @@
 #include <exception>
 #include <iomanip>
-#include <random>
 #include <sstream>
 #include <string>
 
 #include "graphics.h"
+#include "raster.h"
 
 #include <cairommconfig.h>
 #include <cairomm/context.h>
@@ -101,29 +101,14 @@ void draw_domains(const Grid &grid, Cairo::RefPtr<Cairo::ImageSurface> surface)
   cr->restore();
 
   // Draw grid
-  auto proj = grid.project_domains();
-  mt19937 rng;
-  uniform_real_distribution<double> color(0.0, 1.0);
-  cr->save();
-  cr->translate(off_X, off_Y);
-  for (size_t xx = 0; xx < grid.dimensions().X; ++xx) {
-    cr->save();
-    for (size_t yy = 0; yy < grid.dimensions().Y; ++yy) {
-      size_t idx = xx*grid.dimensions().Y + yy;
-      if (proj[idx] != 0) {
-        rng.seed(proj[idx]);
-        cr->set_source_rgb(color(rng), color(rng), color(rng));
-      } else {
-        cr->set_source_rgb(0.0, 0.0, 0.0);
-      }
-      cr->rectangle(0.0, 0.0, cell_W, cell_H);
-      cr->fill();
-      cr->translate(cell_W, 0);
-    }
-    cr->restore();
-    cr->translate(0, cell_H);
-  }
-  cr->restore();
+  surface->flush();
+  vector<size_t> proj;
+  grid.project_domains(proj);
+  PixelBuffer image = {surface->get_data(), surface->get_width(), surface->get_height(),
+                       surface->get_stride()};
+  rasterize_cells(image, proj, grid.dimensions().X, grid.dimensions().Y,
+                  off_X, off_Y, cell_W, cell_H, grid.num_threads());
+  surface->mark_dirty();
 }
 
 void draw_spins(const Grid &grid, Cairo::RefPtr<Cairo::ImageSurface> surface)
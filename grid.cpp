@@ -1,4 +1,7 @@
 #include <algorithm>
+#include <limits>
+#include <numeric>
+#include <stdexcept>
 #include "grid.h"
 
 using namespace std;
@@ -13,84 +16,181 @@ using namespace std;
     for (size_t y = 0; y < dim.Y; ++y)                 \
       for (size_t z = 0; z < dim.Z; ++z)
 
-static const double UC_X = 3.7845e-8;
-static const double UC_Y = 3.7845e-8;
-static const double UC_Z = 9.5143e-8;
-static const double MU_B = 9.274e-21; // emu
+// Stream bit of the domain spins, so they are independent of the defects
+static const uint64_t SPIN_STREAM = uint64_t(1) << 63;
 
-static int MU_B_PER_CELL = 1;
 
+// Volume of a lattice whose cells can all get their own label
+static size_t labeled_volume(const Grid::Dimensions &dim, Grid::GridType grid_type)
+{
+  if (!Grid::valid_dimensions(dim, grid_type))
+    throw invalid_argument("Grid: a hexagonal lattice needs an even Y, not " + to_string(dim.Y));
+  if (dim.volume() >= numeric_limits<label_t>::max())
+    throw length_error("Grid: " + to_string(dim.volume()) + " cells do not fit 32-bit labels, "
+                       "build with -DGRID_WIDE_LABELS");
+  return dim.volume();
+}
 
-Grid::Grid(double P, Grid::Dimensions dim, GridType grid_type, int seed)
+Grid::Grid(double P, Grid::Dimensions dim, GridType grid_type, uint64_t seed)
   : grid_type(grid_type), P(P), dim(dim), seed(seed), generator(seed),
-    cells(dim.volume(), 0), labels(dim.volume(), 0), domains()
+    cells(labeled_volume(dim, grid_type)), labels(dim.volume(), 0)
+{
+}
+
+Grid::~Grid()
+{
+}
+
+// Call f with the lattice policy of grid_type. All lattice dependent code is
+// instantiated per policy, so this is the only place that looks at the type.
+template<typename F>
+static inline void dispatch_lattice(Grid::GridType grid_type, F f)
 {
   switch(grid_type) {
-  case GRID_SC:
-    neighbor_generator = generate_neighbors_SC;
+  case Grid::GRID_HEX:
+    f(LatticeHex());
     break;
-  case GRID_HEX:
-    neighbor_generator = generate_neighbors_Hex;
+  case Grid::GRID_SC:
+  default:
+    f(LatticeSC());
     break;
   }
 }
 
-Grid::~Grid()
+void Grid::search_domains()
 {
+  domain_table_valid = false;
+  label_spins_valid = false;
+  // There are at most occupied provisional labels. Reserving them up front
+  // keeps repeated builds at the same P free of reallocations. The compact
+  // mode trades that for memory.
+  if (!compact) {
+    forest.reserve(occupied + 1);
+    work.relabel.reserve(occupied + 1);
+  }
+  switch(engine) {
+  case LABEL_BFS:
+    dispatch_lattice(grid_type, [&](auto lattice) {
+      search_domains_bfs<decltype(lattice)>();
+    });
+    break;
+  case LABEL_UNION_FIND:
+  default:
+    dispatch_lattice(grid_type, [&](auto lattice) {
+      if (topology) search_domains_halo<decltype(lattice)>();
+      else if (threads > 1) search_domains_slabs<decltype(lattice)>();
+      else if (layout == LAYOUT_HALO) search_domains_halo<decltype(lattice)>();
+      else search_domains_union_find<decltype(lattice)>();
+    });
+    break;
+  }
+  rebuild_stats();
+  peak_memory = max(peak_memory, memory_usage());
+  if (compact) {
+    work = Workspace();
+    forest.shrink_to_fit();
+  }
 }
 
-void Grid::search_domains()
+size_t Grid::memory_usage() const
 {
-  vector<bool> visited(cells.size(), false);
-  domains.clear();
+  auto bytes = [](const auto &v) { return v.capacity()*sizeof(v[0]); };
+  size_t n = cells.num_words()*sizeof(BitLattice::Word) + bytes(labels) + forest.memory_usage()
+    + work.visited.num_words()*sizeof(BitLattice::Word) + bytes(work.stack) + bytes(work.domain)
+    + bytes(work.relabel) + bytes(work.halo_labels)
+    + bytes(work.slab_first) + bytes(work.slab_offsets) + bytes(work.slab_domains)
+    + bytes(work.domain_index) + bytes(work.domain_pos) + bytes(work.faces)
+    + work.picked.num_words()*sizeof(BitLattice::Word)
+    + work.windings.memory_usage() + bytes(work.first_cell) + bytes(work.label_spins)
+    + bytes(domain_table.offsets) + bytes(domain_table.cells) + bytes(domain_table.labels);
+  for (auto &f : work.slab_forests) n += f.memory_usage();
+  return n;
+}
+
+// Statistics of the domains of a fresh labeling, from the root sizes
+void Grid::rebuild_stats()
+{
+  stats.clear();
+  for (size_t l = 1; l < forest.count(); ++l)
+    if (forest.size(l) > 0 && forest.root(l) == l) stats.add(forest.size(l));
+}
+
+size_t Grid::second_domain_len() const
+{
+  if (!stats.is_second_known()) {
+    // Top two root sizes; the largest domain counts once
+    size_t top = 0, second = 0;
+    for (size_t l = 1; l < forest.count(); ++l) {
+      if (forest.root(l) != l) continue;
+      size_t s = forest.size(l);
+      if (s > top) {
+        second = top;
+        top = s;
+      } else if (s > second) {
+        second = s;
+      }
+    }
+    stats.set_second_largest(second);
+  }
+  return stats.second_largest();
+}
+
+template<class Lattice>
+void Grid::search_domains_bfs()
+{
+  BitLattice &visited = work.visited;
+  vector<size_t> &queue = work.stack;
+  vector<size_t> &domain = work.domain;
+  if (visited.size() != cells.size()) visited = BitLattice(cells.size());
+  else visited.clear();
+  domain_count = 0;
+  largest_domain = 0;
   //fill(labels.begin(), labels.end(), 0);
 
   FOR3(x,y,z) {
-    int i = TO_1D(x,y,z);
-    forward_list<int> queue;
+    size_t i = TO_1D(x,y,z);
     if (!visited[i] && cells[i]) {
-      list<int> domain;
       size_t cur_label;
       size_t biggest_domain_size;
 
-      queue.push_front(i);
-      visited[i] = true;
+      queue.push_back(i);
+      visited.set(i);
       if (labels[i] != 0) {
         // The cell i was already labeled in the original grid
         cur_label = labels[i];
-        biggest_domain_size = label_sizes[labels[i]];
-        label_sizes.erase(cur_label);
+        biggest_domain_size = forest.size(labels[i]);
+        forest.size(cur_label) = 0;
       } else {
         cur_label = next_new_label;
         biggest_domain_size = 1;
         labels[i] = cur_label;
       }
+      domain.clear();
       domain.push_back(i);
 
       while(!queue.empty()) {
-        i = queue.front();
-        queue.pop_front();
+        i = queue.back();
+        queue.pop_back();
 
-        auto neighbors = neighbor_generator(i, dim);
-        for (auto ni : neighbors) {
+        for_each_neighbor<Lattice>(X_FROM_1D(i), Y_FROM_1D(i), Z_FROM_1D(i), dim, [&](size_t ni) {
           if (!visited[ni] && cells[ni]) {
-            queue.push_front(ni);
-            visited[ni] = true;
-            if (labels[i] != 0 && labels[i] != cur_label) {
+            queue.push_back(ni);
+            visited.set(ni);
+            if (labels[ni] != 0 && labels[ni] != cur_label) {
               // We reached another domain. We keep the label of the bigger
               // domain and merge them together.
-              if (label_sizes[labels[i]] > biggest_domain_size) {
-                cur_label = labels[i];
-                biggest_domain_size = label_sizes[labels[i]];
+              if (forest.size(labels[ni]) > biggest_domain_size) {
+                cur_label = labels[ni];
+                biggest_domain_size = forest.size(labels[ni]);
               }
               // Either the label will not be used anymore, or we update the
               // size at the end. So we don't need the entry anymore.
-              label_sizes.erase(labels[i]);
+              forest.size(labels[ni]) = 0;
             }
             labels[ni] = cur_label;
             domain.push_back(ni);
           }
-        }
+        });
       }
 
       // If a completely new label was used, increment the next label used
@@ -98,120 +198,637 @@ void Grid::search_domains()
 
       // Relabel all cells of the domain and update the label size
       for (auto i : domain) labels[i] = cur_label;
-      label_sizes[cur_label] = domain.size();
+      forest.grow(cur_label+1);
+      forest.size(cur_label) = domain.size();
+
+      domain_count++;
+      if (domain.size() > largest_domain) largest_domain = domain.size();
+    }
+  }
+}
 
-      domains.push_back(domain);
+// Label the occupied cell i at (x,y,z) and merge it with the domains of its
+// labeled neighbors with an index in [first, first+len). The cell keeps a
+// provisional label, its domain is given by the root of that label in the
+// forest. Returns the root; domains is incremented for a new domain and
+// decremented for every merge. The changes are also applied to stats, if
+// given.
+template<class Lattice>
+static inline size_t label_cell(UnionFind &forest, label_t *labels, const Grid::Dimensions &dim,
+                                size_t i, size_t x, size_t y, size_t z,
+                                size_t first, size_t len, long &domains,
+                                ClusterStats *stats = nullptr)
+{
+  size_t label = 0;
+  for_each_neighbor<Lattice>(x, y, z, dim, [&](size_t ni) {
+    if (ni - first >= len || labels[ni] == 0) return;
+    size_t r = forest.find(labels[ni]);
+    if (label == 0) {
+      label = r;
+    } else if (r != label) {
+      if (stats) stats->merge(forest.size(label), forest.size(r));
+      label = forest.unite(label, r);
+      domains--;
     }
+  });
+  if (label == 0) {
+    label = forest.make_set();
+    domains++;
+    if (stats) stats->add(1);
+  } else {
+    if (stats) stats->grow(forest.size(label));
+    forest.size(label)++;
   }
+  labels[i] = label;
+  return label;
 }
 
+// Hoshen-Kopelman labeling: a single pass over the lattice assigns
+// provisional labels and merges them in a union-find forest as soon as two
+// labels touch. The second pass renumbers the domains in the order of their
+// first cell, which gives the same labels as the BFS engine on a fresh grid.
+template<class Lattice>
+void Grid::search_domains_union_find()
+{
+  fill(labels.begin(), labels.end(), 0);
+  forest.clear();
+  long domains = 0;
+
+  // Walk the runs of occupied cells, skipping empty words. The domain
+  // statistics are computed from the final forest.
+  for (size_t i = cells.find_next(0); i < cells.size(); i = cells.find_next(i)) {
+    size_t run_end = cells.find_next_clear(i);
+    size_t x = X_FROM_1D(i), y = Y_FROM_1D(i), z = Z_FROM_1D(i);
+    for (; i < run_end; ++i) {
+      label_cell<Lattice>(forest, labels.data(), dim, i, x, y, z, 0, labels.size(), domains);
+      if (++z == dim.Z) {
+        z = 0;
+        if (++y == dim.Y) {
+          y = 0;
+          ++x;
+        }
+      }
+    }
+  }
+
+  domain_count = domains;
+  compact_labels([&](size_t i, size_t, size_t, size_t) { return labels[i]; });
+}
+
+// Faces of the lattice that the cell (x,y,z) lies on: bit 2d for the face
+// at 0 and bit 2d+1 for the far face of axis d
+static inline uint8_t cell_faces(size_t x, size_t y, size_t z, const Grid::Dimensions &dim)
+{
+  return (x == 0) | (x+1 == dim.X) << 1 | (y == 0) << 2 | (y+1 == dim.Y) << 3
+    | (z == 0) << 4 | (z+1 == dim.Z) << 5;
+}
+
+// Hoshen-Kopelman labeling on a copy of the labels with ghost layers. The
+// first pass only looks at the neighbors before each cell, which are at
+// fixed offsets and never need a periodic wrap. The bonds across the
+// periodic boundaries are merged afterwards from the boundary cells, after
+// a halo exchange has copied their labels into the ghost layers.
+//
+// The first pass thus labels the lattice with open boundaries. With the
+// topology tracked, every root carries the faces its domain touches, which
+// gives the spanning axes, and the periodic bonds join the open domains in
+// a winding forest, which gives the wrapping axes.
+template<class Lattice>
+void Grid::search_domains_halo()
+{
+  HaloLayout halo(dim);
+  work.halo_labels.assign(halo.volume(), 0);
+  forest.clear();
+  domain_count = 0;
+  largest_domain = 0;
+  spanning = 0;
+  wrapping = 0;
+  vector<uint8_t> &faces = work.faces;
+  if (topology) {
+    if (!compact) faces.reserve(occupied + 1);
+    faces.assign(1, 0);
+  }
+
+  // Backward offsets per row parity
+  ptrdiff_t back[2][Lattice::NUM_NEIGHBORS];
+  int num_back[2] = {0, 0};
+  for (int parity = 0; parity < 2; ++parity)
+    for (int k = 0; k < Lattice::NUM_NEIGHBORS; ++k)
+      if (is_backward(Lattice::stencil(parity)[k]))
+        back[parity][num_back[parity]++] = halo.offset(Lattice::stencil(parity)[k]);
+
+  for (size_t i = cells.find_next(0); i < cells.size(); i = cells.find_next(i)) {
+    size_t run_end = cells.find_next_clear(i);
+    size_t x = X_FROM_1D(i), y = Y_FROM_1D(i), z = Z_FROM_1D(i);
+    for (; i < run_end; ++i) {
+      size_t p = halo.index(x, y, z);
+      size_t label = 0;
+      for (int k = 0; k < num_back[y%2]; ++k) {
+        size_t l = work.halo_labels[p + back[y%2][k]];
+        if (l == 0) continue;
+        if (label == 0) {
+          label = forest.find(l);
+        } else if (forest.find(l) != label) {
+          size_t r = forest.find(l);
+          size_t merged = forest.unite(label, r);
+          if (topology) faces[merged] = faces[label] | faces[r];
+          label = merged;
+          domain_count--;
+        }
+      }
+      if (label == 0) {
+        label = forest.make_set();
+        domain_count++;
+        if (topology) faces.push_back(0);
+      } else {
+        forest.size(label)++;
+      }
+      if (topology) faces[label] |= cell_faces(x, y, z, dim);
+      work.halo_labels[p] = label;
+
+      if (++z == dim.Z) {
+        z = 0;
+        if (++y == dim.Y) {
+          y = 0;
+          ++x;
+        }
+      }
+    }
+  }
+
+  halo.exchange(work.halo_labels.data());
+
+  // A domain of the open lattice spans an axis if it touches both faces.
+  // All labels of an open domain start out in one winding tree.
+  if (topology) {
+    work.windings.reset(forest.count());
+    for (size_t l = 1; l < forest.count(); ++l) {
+      size_t r = forest.find(l);
+      work.windings.link(l, r);
+      if (r != l) continue;
+      for (int d = 0; d < 3; ++d)
+        if ((faces[l] >> 2*d & 3) == 3) spanning |= 1u << d;
+    }
+  }
+
+  // Bonds that reach into the ghost layers start at a boundary cell
+  auto merge_boundary = [&](size_t x, size_t y, size_t z) {
+    size_t p = halo.index(x, y, z);
+    if (work.halo_labels[p] == 0) return;
+    const Offset *s = Lattice::stencil(y);
+    for (int k = 0; k < Lattice::NUM_NEIGHBORS; ++k) {
+      if (!is_backward(s[k])) continue;
+      ptrdiff_t nx = x + s[k].dx, ny = y + s[k].dy, nz = z + s[k].dz;
+      if (nx >= 0 && nx < (ptrdiff_t)dim.X && ny >= 0 && ny < (ptrdiff_t)dim.Y
+          && nz >= 0 && nz < (ptrdiff_t)dim.Z) continue;
+      size_t l = work.halo_labels[p + halo.offset(s[k])];
+      if (l == 0) continue;
+      if (topology) {
+        // The neighbor is the periodic image, w periods away
+        WindingForest::Shift w = {{nx < 0 ? -1 : nx >= (ptrdiff_t)dim.X ? 1 : 0,
+                                   ny < 0 ? -1 : ny >= (ptrdiff_t)dim.Y ? 1 : 0,
+                                   nz < 0 ? -1 : nz >= (ptrdiff_t)dim.Z ? 1 : 0}};
+        wrapping |= work.windings.unite(work.halo_labels[p], l, w);
+      }
+      if (forest.find(l) != forest.find(work.halo_labels[p])) {
+        forest.unite(l, work.halo_labels[p]);
+        domain_count--;
+      }
+    }
+  };
+  for (size_t x = 0; x < dim.X; ++x) {
+    for (size_t y = 0; y < dim.Y; ++y) {
+      bool face = x == 0 || x+1 == dim.X || y == 0 || y+1 == dim.Y;
+      size_t step = (face || dim.Z < 2) ? 1 : dim.Z-1;
+      for (size_t z = 0; z < dim.Z; z += step) merge_boundary(x, y, z);
+    }
+  }
+
+  compact_labels([&](size_t, size_t x, size_t y, size_t z) {
+    return work.halo_labels[halo.index(x, y, z)];
+  });
+}
+
+// Renumber the domains in the order of their first cell and reset the
+// forest so that every label is a root. provisional(i,x,y,z) returns the
+// label of cell i from the labeling pass.
+template<typename F>
+void Grid::compact_labels(F provisional)
+{
+  work.relabel.assign(forest.count(), 0);
+  size_t domains = 0;
+  size_t i = 0;
+  FOR3(x,y,z) {
+    size_t l = provisional(i, x, y, z);
+    if (l != 0) {
+      size_t r = forest.find(l);
+      if (work.relabel[r] == 0) work.relabel[r] = ++domains;
+      l = work.relabel[r];
+    }
+    labels[i++] = l;
+  }
+  reset_forest(domains);
+}
+
+// Replace the forest by one root per domain, once the cells carry the new
+// labels from work.relabel. The labeling passes create the provisional
+// labels in cell order, so no root gets a larger new label than itself and
+// the sizes of the new labels can overwrite work.relabel in place, in
+// ascending order. This saves a table of the domain sizes at the peak.
+void Grid::reset_forest(size_t domains)
+{
+  peak_memory = max(peak_memory, memory_usage());
+  vector<label_t> &sizes = work.relabel;
+  for (size_t l = 1; l < forest.count(); ++l)
+    if (forest.root(l) == l && work.relabel[l] != 0) {
+      assert(work.relabel[l] <= l);
+      sizes[work.relabel[l]] = forest.size(l);
+    }
+
+  forest.clear();
+  largest_domain = 0;
+  for (size_t l = 1; l <= domains; ++l) {
+    forest.make_set(sizes[l]);
+    if (sizes[l] > largest_domain) largest_domain = sizes[l];
+  }
+  next_new_label = domains + 1;
+}
+
+template<class Lattice>
+void Grid::merge_cell(size_t i, size_t x, size_t y, size_t z)
+{
+  long domains = 0;
+  size_t label = label_cell<Lattice>(forest, labels.data(), dim, i, x, y, z,
+                                     0, labels.size(), domains, &stats);
+  domain_count += domains;
+  if (forest.size(label) > largest_domain) largest_domain = forest.size(label);
+}
+
+// Label the cells with x in [x_first, x_last) into a forest of their own,
+// ignoring the bonds to other slabs. Returns the number of domains.
+template<class Lattice>
+static long label_slab(const BitLattice &cells, label_t *labels, UnionFind &forest,
+                       const Grid::Dimensions &dim, size_t x_first, size_t x_last)
+{
+  size_t first = x_first*dim.Y*dim.Z, last = x_last*dim.Y*dim.Z;
+  long domains = 0;
+  forest.clear();
+  fill(labels + first, labels + last, 0);
+  for (size_t i = cells.find_next(first); i < last; i = cells.find_next(i)) {
+    size_t run_end = min(cells.find_next_clear(i), last);
+    size_t x = X_FROM_1D(i), y = Y_FROM_1D(i), z = Z_FROM_1D(i);
+    for (; i < run_end; ++i) {
+      label_cell<Lattice>(forest, labels, dim, i, x, y, z, first, last - first, domains);
+      if (++z == dim.Z) {
+        z = 0;
+        if (++y == dim.Y) {
+          y = 0;
+          ++x;
+        }
+      }
+    }
+  }
+  return domains;
+}
+
+// Label the lattice in x-slabs on several threads. Every slab is labeled
+// with its own forest, then the forests are concatenated and the bonds
+// across the slab boundaries, including the periodic one at x = 0, are
+// merged. The domains are numbered in the order of their root labels.
+template<class Lattice>
+void Grid::search_domains_slabs()
+{
+  size_t num_slabs = min(threads, dim.X);
+  size_t slab_volume = dim.Y*dim.Z;
+  work.slab_forests.resize(num_slabs);
+  vector<size_t> &x_first = work.slab_first, &offsets = work.slab_offsets;
+  x_first.resize(num_slabs+1);
+  offsets.resize(num_slabs);
+  for (size_t s = 0; s <= num_slabs; ++s) x_first[s] = s*dim.X/num_slabs;
+
+  work.slab_domains.resize(num_slabs);
+  team.run(num_slabs, [&](size_t s) {
+    work.slab_domains[s] = label_slab<Lattice>(cells, labels.data(), work.slab_forests[s],
+                                               dim, x_first[s], x_first[s+1]);
+  });
+  long domains = 0;
+  for (long d : work.slab_domains) domains += d;
+
+  forest.clear();
+  size_t count = 1;
+  for (auto &f : work.slab_forests) count += f.count() - 1;
+  forest.reserve(count);
+  for (size_t s = 0; s < num_slabs; ++s) {
+    offsets[s] = forest.append(work.slab_forests[s]);
+    // A compact grid releases every slab forest once it is appended
+    if (compact) {
+      peak_memory = max(peak_memory, memory_usage());
+      work.slab_forests[s] = UnionFind();
+    }
+  }
+
+  // Shift the slab labels to the concatenated forest
+  team.run(num_slabs, [&](size_t s) {
+    for (size_t i = x_first[s]*slab_volume; i < x_first[s+1]*slab_volume; ++i)
+      if (labels[i] != 0) labels[i] += offsets[s];
+  });
+
+  // Stitch the first layer of every slab to its neighbor slabs
+  for (size_t s = 0; s < num_slabs; ++s) {
+    size_t first = x_first[s]*slab_volume, len = (x_first[s+1]-x_first[s])*slab_volume;
+    for (size_t i = cells.find_next(first); i < first + slab_volume; i = cells.find_next(i+1)) {
+      for_each_neighbor<Lattice>(X_FROM_1D(i), Y_FROM_1D(i), Z_FROM_1D(i), dim, [&](size_t ni) {
+        if (ni - first < len || labels[ni] == 0) return;
+        if (forest.find(labels[ni]) != forest.find(labels[i])) {
+          forest.unite(labels[ni], labels[i]);
+          domains--;
+        }
+      });
+    }
+  }
+
+  // Number the roots and resolve the labels of all cells
+  work.relabel.assign(forest.count(), 0);
+  size_t roots = 0;
+  for (size_t l = 1; l < forest.count(); ++l)
+    if (forest.find(l) == l) work.relabel[l] = ++roots;
+  team.run(num_slabs, [&](size_t s) {
+    for (size_t i = x_first[s]*slab_volume; i < x_first[s+1]*slab_volume; ++i)
+      if (labels[i] != 0) labels[i] = work.relabel[forest.root(labels[i])];
+  });
+
+  reset_forest(roots);
+  domain_count = domains;
+}
+
+void Grid::reset_cells()
+{
+  cells.clear();
+  fill(labels.begin(), labels.end(), 0);
+  forest.clear();
+  next_new_label = 1;
+  occupied = 0;
+  domain_count = 0;
+  largest_domain = 0;
+  spanning = 0;
+  wrapping = 0;
+  stats.clear();
+  domain_table_valid = false;
+  label_spins_valid = false;
+}
+
+void Grid::clear()
+{
+  reset_cells();
+  P = 0.0;
+}
+
+void Grid::occupy(size_t i)
+{
+  assert(!cells[i]);
+  cells.set(i);
+  occupied++;
+  dispatch_lattice(grid_type, [&](auto lattice) {
+    merge_cell<decltype(lattice)>(i, X_FROM_1D(i), Y_FROM_1D(i), Z_FROM_1D(i));
+  });
+  next_new_label = forest.count();
+  domain_table_valid = false;
+  label_spins_valid = false;
+  P = (double)occupied / (double)dim.volume();
+}
+
+void Grid::random_order(vector<size_t> &order)
+{
+  order.resize(dim.volume());
+  iota(order.begin(), order.end(), 0);
+  shuffle(order.begin(), order.end(), generator);
+}
+
+// Place floor(V*P) defects with Floyd's algorithm: for j = V-n .. V-1, pick
+// t in [0, j] and take t, or j if t is already taken. This draws an exact
+// count uniform sample straight into the occupancy field in O(n).
 void Grid::build()
 {
-  fill(cells.begin(), cells.end(), false);
+  reset_cells();
 
-  // randomly distribute defects
-  vector<int> candidates;
-  candidates.reserve(dim.volume());
-  list<int> defects;
-  for (size_t i = 0; i < dim.volume(); ++i) candidates.push_back(i);
-  sample(candidates.begin(), candidates.end(), back_inserter(defects),
-         static_cast<size_t>(dim.volume()*P), generator);
-  for (auto i : defects) cells[i] = true;
+  size_t V = dim.volume();
+  size_t n = static_cast<size_t>(V*P);
+  for (size_t j = V - n; j < V; ++j) {
+    size_t t = generator.uniform(j + 1);
+    cells.set(cells[t] ? j : t);
+  }
+  occupied = n;
 
   search_domains();
 }
 
+// Add defects at random empty cells until there are target, and call
+// added(i) for every new defect i. While at least half of the cells are
+// empty, the empty cells are drawn by rejection with at most 2 draws per
+// defect on average. Beyond that, rejection would need 1/(1-P) draws per
+// defect, so Floyd's algorithm picks the ranks of the new defects among the
+// F empty cells, with one draw per defect, and one pass over the empty
+// cells places them.
+template<typename F>
+void Grid::add_defects(size_t target, F added)
+{
+  size_t V = dim.volume();
+  size_t free = V - occupied, num = target - occupied;
+  if (2*free >= V) {
+    for (; occupied < target; ++occupied) {
+      size_t i;
+      do i = generator.uniform(V); while (cells[i]);
+      cells.set(i);
+      added(i);
+    }
+    return;
+  }
+
+  BitLattice &picked = work.picked;
+  if (picked.size() < free) picked = BitLattice(V);
+  else picked.clear();
+  for (size_t j = free - num; j < free; ++j) {
+    size_t t = generator.uniform(j + 1);
+    picked.set(picked[t] ? j : t);
+  }
+  size_t rank = 0;
+  for (size_t i = cells.find_next_clear(0); i < V; i = cells.find_next_clear(i + 1)) {
+    if (picked[rank++]) {
+      cells.set(i);
+      added(i);
+    }
+  }
+  occupied = target;
+}
+
+// Add defects until there are floor(V*newP), rounded down like in build(),
+// and merge them into the domains.
 void Grid::update(double newP)
 {
   assert(newP >= P);
   if (newP == P) return;
 
-  // randomly distribute defects
-  vector<int> candidates;
-  candidates.reserve(dim.volume());
-  list<int> defects;
-  for (size_t i = 0; i < dim.volume(); ++i) if (!cells[i]) candidates.push_back(i);
-  size_t sample_size = static_cast<size_t>(dim.volume()*newP - dim.volume()*P);
-  //assert(sample_size <= candidates.size());
-  sample(candidates.begin(), candidates.end(), back_inserter(defects),
-         sample_size, generator);
-  for (auto i : defects) cells[i] = true;
+  size_t V = dim.volume();
+  size_t target = min(V, static_cast<size_t>(V*newP));
   P = newP;
-  search_domains();
+  if (target <= occupied) return;
+
+  if (engine == LABEL_BFS || topology) {
+    add_defects(target, [](size_t) {});
+    search_domains();
+    return;
+  }
+  // New defects can only merge domains, so it is enough to merge every
+  // added cell into the existing forest.
+  dispatch_lattice(grid_type, [&](auto lattice) {
+    add_defects(target, [&](size_t i) {
+      merge_cell<decltype(lattice)>(i, X_FROM_1D(i), Y_FROM_1D(i), Z_FROM_1D(i));
+    });
+  });
+  next_new_label = forest.count();
+  domain_table_valid = false;
+  label_spins_valid = false;
 }
 
-forward_list<int> generate_neighbors_SC(int i, const Grid::Dimensions &dim) {
-  forward_list<int> neighbors;
-  int x = X_FROM_1D(i), y = Y_FROM_1D(i), z = Z_FROM_1D(i);
-  neighbors.push_front(TO_1D((dim.X+x-1)%dim.X, y, z));
-  neighbors.push_front(TO_1D((dim.X+x+1)%dim.X, y, z));
-  neighbors.push_front(TO_1D(x, (dim.Y+y-1)%dim.Y, z));
-  neighbors.push_front(TO_1D(x, (dim.Y+y+1)%dim.Y, z));
-  neighbors.push_front(TO_1D(x, y, (dim.Z+z-1)%dim.Z));
-  neighbors.push_front(TO_1D(x, y, (dim.Z+z+1)%dim.Z));
-  return neighbors;
+// Sort the occupied cells by domain with a counting sort over the root
+// labels of the forest.
+const DomainTable& Grid::domains() const
+{
+  if (domain_table_valid) return domain_table;
+  DomainTable &t = domain_table;
+
+  t.offsets.reserve(occupied + 1);
+  t.offsets.assign(1, 0);
+  t.labels.reserve(occupied);
+  t.labels.clear();
+  vector<size_t> &index = work.domain_index;
+  index.reserve(occupied + 1);
+  index.assign(forest.count(), 0);
+  for (size_t l = 1; l < forest.count(); ++l) {
+    if (forest.size(l) == 0 || forest.root(l) != l) continue;
+    index[l] = t.labels.size();
+    t.labels.push_back(l);
+    t.offsets.push_back(t.offsets.back() + forest.size(l));
+  }
+
+  vector<size_t> &pos = work.domain_pos;
+  pos.reserve(occupied);
+  pos.assign(t.offsets.begin(), t.offsets.end() - 1);
+  t.cells.resize(occupied);
+  for (size_t i = 0; i < labels.size(); ++i)
+    if (labels[i] != 0) t.cells[pos[index[forest.root(labels[i])]]++] = i;
+
+  domain_table_valid = true;
+  return domain_table;
 }
 
-forward_list<int> generate_neighbors_Hex(int i, const Grid::Dimensions &dim)
+void Grid::project(const Projection &out) const
 {
-  forward_list<int> neighbors;
-  int x = X_FROM_1D(i), y = Y_FROM_1D(i), z = Z_FROM_1D(i);
-  neighbors.push_front(TO_1D((dim.X+x-1)%dim.X, y, z));
-  neighbors.push_front(TO_1D((dim.X+x+1)%dim.X, y, z));
-  neighbors.push_front(TO_1D((dim.X+x-(y%2))%dim.X, (dim.Y+y-1)%dim.Y, z));
-  neighbors.push_front(TO_1D((dim.X+x-(y%2)+1)%dim.X, (dim.Y+y-1)%dim.Y, z));
-  neighbors.push_front(TO_1D((dim.X+x-(y%2))%dim.X, (dim.Y+y+1)%dim.Y, z));
-  neighbors.push_front(TO_1D((dim.X+x-(y%2)+1)%dim.X, (dim.Y+y+1)%dim.Y, z));
-  neighbors.push_front(TO_1D(x, y, (dim.Z+z-1)%dim.Z));
-  neighbors.push_front(TO_1D(x, y, (dim.Z+z+1)%dim.Z));
-  return neighbors;
+  size_t num_threads = min(threads, dim.X);
+  auto rows = [&](size_t t) { return dim.X*t / num_threads; };
+
+  // The spin of a domain is addressed by its first cell, so it does not
+  // depend on the label numbering. The smallest cell index of every label
+  // goes to its root, and every label gets the spin of its root, so the
+  // column pass only looks up the spins of the labels.
+  vector<int8_t> &spins = work.label_spins;
+  if (out.spins && !label_spins_valid) {
+    const size_t none = numeric_limits<size_t>::max();
+    size_t n = forest.count();
+    // The tables grow with the capacity of the forest, so they only
+    // reallocate when the forest did
+    if (work.first_cell.size() < n) work.first_cell = vector<atomic<size_t>>(forest.capacity());
+    if (spins.capacity() < n) spins.reserve(forest.capacity());
+    vector<atomic<size_t>> &first = work.first_cell;
+    auto min_into = [&](size_t l, size_t i) {
+      size_t f = first[l].load(memory_order_relaxed);
+      while (i < f && !first[l].compare_exchange_weak(f, i, memory_order_relaxed)) {}
+    };
+    auto labels_of = [&](size_t t) { return 1 + (n - 1)*t / num_threads; };
+    spins.resize(n);
+    spins[0] = 0;
+    team.run(num_threads, [&](size_t t) {
+      for (size_t l = labels_of(t), end = labels_of(t+1); l < end; ++l)
+        first[l].store(none, memory_order_relaxed);
+    });
+    team.run(num_threads, [&](size_t t) {
+      // Runs of cells with the same label along z are common
+      size_t last = 0, end = rows(t+1)*dim.Y*dim.Z;
+      for (size_t i = rows(t)*dim.Y*dim.Z; i < end; ++i) {
+        if (labels[i] == 0 || labels[i] == last) continue;
+        last = labels[i];
+        min_into(last, i);
+      }
+    });
+    team.run(num_threads, [&](size_t t) {
+      for (size_t l = labels_of(t), end = labels_of(t+1); l < end; ++l) {
+        size_t r = forest.root(l);
+        if (r != l) min_into(r, first[l].load(memory_order_relaxed));
+      }
+    });
+    team.run(num_threads, [&](size_t t) {
+      for (size_t l = labels_of(t), end = labels_of(t+1); l < end; ++l) {
+        size_t f = first[l].load(memory_order_relaxed);
+        if (forest.root(l) == l && f != none)
+          spins[l] = PhiloxEngine::at(seed, stream | SPIN_STREAM, f) & 1 ? 1 : -1;
+      }
+    });
+    team.run(num_threads, [&](size_t t) {
+      for (size_t l = labels_of(t), end = labels_of(t+1); l < end; ++l) {
+        size_t r = forest.root(l);
+        if (r != l) spins[l] = spins[r];
+      }
+    });
+    label_spins_valid = true;
+  }
+
+  // One pass over the z-contiguous columns of every x row
+  team.run(num_threads, [&](size_t t) {
+    for (size_t c = rows(t)*dim.Y, end = rows(t+1)*dim.Y; c < end; ++c) {
+      const label_t *column = labels.data() + c*dim.Z;
+      if (out.grid) out.grid[c] = (double)cells.count(c*dim.Z, (c+1)*dim.Z) / (double)dim.Z;
+      if (out.domains) {
+        // Root label of the top-most occupied cell
+        out.domains[c] = 0;
+        for (size_t z = dim.Z; z-- > 0;) {
+          if (column[z] == 0) continue;
+          out.domains[c] = forest.root(column[z]);
+          break;
+        }
+      }
+      if (out.spins) {
+        long sum = 0;
+        for (size_t z = 0; z < dim.Z; ++z) sum += spins[column[z]];
+        out.spins[c] = (double)sum / (double)dim.Z;
+      }
+    }
+  });
 }
 
 void Grid::project_grid(vector<double> &out) const
 {
   if (out.size() != dim.area()) out.resize(dim.area(), 0.0);
-  for (size_t x = 0; x < dim.X; x++) {
-    for (size_t y = 0; y < dim.Y; y++) {
-      size_t i = x*dim.Y+y;
-      out[i] = 0.0;
-      for (size_t z = 0; z < dim.Z; z++) {
-        out[i] += (double)cells[TO_1D(x,y,z)];
-      }
-      out[i] /= (double)dim.Z;
-    }
-  }
+  project({out.data(), nullptr, nullptr});
 }
 
 void Grid::project_domains(vector<size_t> &out) const
 {
-  if (out.size() != dim.area()) out.resize(dim.area(), 0.0);
-  vector<int> zindex(dim.area(), 0);
-  int nd = 1;
-  for (auto& domain : domains) {
-    for (auto i : domain) {
-      int idx = i / dim.Z;
-      int z = Z_FROM_1D(i);
-      if (zindex[idx] <= z) {
-        zindex[idx] = z;
-        out[idx] = labels[i];
-      }
-    }
-    nd++;
-  }
+  if (out.size() != dim.area()) out.resize(dim.area(), 0);
+  project({nullptr, out.data(), nullptr});
 }
 
 void Grid::project_spins(vector<double> &out) const
 {
-  mt19937 rng(seed);
   if (out.size() != dim.area()) out.resize(dim.area(), 0.0);
-  uniform_int_distribution<int> spin_dist(0,1);
+  project({nullptr, nullptr, out.data()});
+}
 
-  for (auto& domain : domains) {
-    int s = spin_dist(rng) ? 1 : -1;
-    for (auto i : domain) {
-      out[i / dim.Z] += (double)s;
-    }
-  }
-  for (size_t i = 0; i < out.size(); i++)
-    out[i] /= (double)dim.Z;
+const vector<int64_t>& Grid::net_spins(size_t realizations) const
+{
+  SpinSums &spins = work.spins;
+  spins.reset(seed, stream, realizations);
+  for (size_t l = 1; l < forest.count(); ++l)
+    if (forest.size(l) > 0 && forest.root(l) == l) spins.add(forest.size(l));
+  spins.finish();
+  return spins.net_spins();
 }
@@ -1,10 +1,10 @@
 #ifndef GRID_H
 #define GRID_H
 
+#include <algorithm>
+#include <atomic>
 #include <cassert>
 #include <cstring>
-#include <functional>
-#include <forward_list>
 #include <fstream>
 #include <iostream>
 #include <list>
@@ -14,13 +14,73 @@
 #include <unordered_map>
 #include <vector>
 
+#include "bitlattice.h"
+#include "clusterstats.h"
+#include "lattice.h"
+#include "magnetization.h"
+#include "philox.h"
+#include "threadteam.h"
+#include "unionfind.h"
+
+
+// Domains stored in compressed sparse row form: the cell indices of all
+// domains in one contiguous array and the offset of each domain in it.
+class DomainTable
+{
+public:
+  class Domain
+  {
+  public:
+    Domain(const size_t *first, const size_t *last) : first(first), last(last) {}
+    const size_t* begin() const { return first; }
+    const size_t* end() const { return last; }
+    size_t size() const { return last - first; }
+  private:
+    const size_t *first;
+    const size_t *last;
+  };
+
+  class iterator
+  {
+  public:
+    iterator(const DomainTable *table, size_t d) : table(table), d(d) {}
+    Domain operator*() const { return (*table)[d]; }
+    iterator& operator++() { ++d; return *this; }
+    bool operator!=(const iterator &other) const { return d != other.d; }
+  private:
+    const DomainTable *table;
+    size_t d;
+  };
+
+  size_t size() const { return offsets.size() - 1; }
+  Domain operator[](size_t d) const {
+    return Domain(cells.data() + offsets[d], cells.data() + offsets[d+1]);
+  }
+  // Label of the domain d
+  size_t label(size_t d) const { return labels[d]; }
+  iterator begin() const { return iterator(this, 0); }
+  iterator end() const { return iterator(this, size()); }
+
+private:
+  friend class Grid;
+  std::vector<size_t> offsets{0};
+  std::vector<size_t> cells;
+  std::vector<size_t> labels;
+};
 
 
 class Grid
 {
+  friend class Snapshot;
 public:
   enum ProjectionType {PROJECT_GRID, PROJECT_DOMAINS, PROJECT_SPINS};
   enum GridType {GRID_SC, GRID_HEX};
+  enum LabelingEngine {LABEL_BFS, LABEL_UNION_FIND};
+  // Storage of the labels during a union-find labeling pass. LAYOUT_HALO
+  // pads the lattice with ghost layers to avoid periodic index wrapping.
+  enum Layout {LAYOUT_PERIODIC, LAYOUT_HALO};
+  // Bits of spanning_axes() and wrapping_axes()
+  enum Axis {AXIS_X = 1, AXIS_Y = 2, AXIS_Z = 4};
   struct Dimensions
   {
     size_t X;
@@ -29,30 +89,139 @@ public:
     size_t volume() const { return X*Y*Z; }
     size_t area() const { return X*Y; }
   };
-  typedef std::function<std::forward_list<int>(int, const Grid::Dimensions&)> NeighborGenerator;
   
 protected:
   GridType grid_type;
   double P;
   Dimensions dim;
-  NeighborGenerator neighbor_generator;
+  LabelingEngine engine = LABEL_UNION_FIND;
+  Layout layout = LAYOUT_PERIODIC;
+  size_t threads = 1;
+  bool compact = false;
+  bool topology = false;
+  size_t peak_memory = 0;
 
-  int seed = 0;
-  std::mt19937 generator{seed};
+  // The random numbers of a grid come from the Philox stream (seed, stream)
+  uint64_t seed = 0;
+  uint64_t stream = 0;
+  PhiloxEngine generator;
   
-  std::vector<bool> cells;
-  std::vector<size_t> labels;
-  std::unordered_map<size_t, size_t> label_sizes;
+  BitLattice cells;
+  std::vector<label_t> labels;
+  UnionFind forest;
   size_t next_new_label = 1;
-  std::list<std::list<int>> domains;
+  // Built on demand by domains()
+  mutable DomainTable domain_table;
+  mutable bool domain_table_valid = false;
+  // The spins of the labels for project(), valid until the labels change
+  mutable bool label_spins_valid = false;
+
+  size_t occupied = 0;
+  size_t domain_count = 0;
+  size_t largest_domain = 0;
+  unsigned spanning = 0;
+  unsigned wrapping = 0;
+  // The second largest domain is recomputed on demand
+  mutable ClusterStats stats;
+
+  // Scratch buffers of the labeling passes and domains(). They keep their
+  // capacity, so a grid that is built over and over, like the per-worker
+  // grids of sim, stops allocating once they have grown to full size.
+  struct Workspace
+  {
+    BitLattice visited;
+    // Ranks of the empty cells that update() occupies
+    BitLattice picked;
+    std::vector<size_t> stack;
+    std::vector<size_t> domain;
+    // New label of every root, then the size of every new label
+    std::vector<label_t> relabel;
+    std::vector<label_t> halo_labels;
+    std::vector<UnionFind> slab_forests;
+    std::vector<size_t> slab_first;
+    std::vector<size_t> slab_offsets;
+    std::vector<long> slab_domains;
+    std::vector<size_t> domain_index;
+    std::vector<size_t> domain_pos;
+    // Faces touched by every label and the periodic joins of the domains,
+    // when the topology is tracked
+    std::vector<uint8_t> faces;
+    WindingForest windings;
+    SpinSums spins;
+    // First cell and spin of every label for project()
+    std::vector<std::atomic<size_t>> first_cell;
+    std::vector<int8_t> label_spins;
+  };
+  mutable Workspace work;
+  // Threads of the slab labeling and project(), kept for the next build
+  mutable ThreadTeam team;
 
 public:
-  explicit Grid(double P, Dimensions dim, GridType grid_type=GRID_SC, int seed=0);
+  // Throws invalid_argument for dimensions that fail valid_dimensions(),
+  // and length_error for more cells than label_t can number
+  explicit Grid(double P, Dimensions dim, GridType grid_type=GRID_SC, uint64_t seed=0);
+  // The rows of a hexagonal lattice alternate their shift in x, so the
+  // neighbors across the periodic y boundary only match for an even Y
+  static bool valid_dimensions(const Dimensions &dim, GridType grid_type) {
+    return grid_type != GRID_HEX || dim.Y % 2 == 0;
+  }
   ~Grid();
-  void set_seed(int val) { seed = val; generator.seed(val); }
+  void set_seed(uint64_t val) {
+    seed = val;
+    generator.seed(seed, stream);
+    label_spins_valid = false;
+  }
+  // Select the random stream, e.g. PhiloxEngine::stream_id(P index, grid index)
+  void set_stream(uint64_t val) {
+    stream = val;
+    generator.seed(seed, stream);
+    label_spins_valid = false;
+  }
+  void set_labeling_engine(LabelingEngine val) { engine = val; }
+  void set_layout(Layout val) { layout = val; }
+  // Number of threads used to label a grid in x-slabs. With more than one
+  // thread the labels are the same as with one thread up to renaming.
+  void set_threads(size_t val) { threads = val > 0 ? val : 1; }
+  // Release the scratch buffers after every labeling pass instead of
+  // keeping them for the next build. Together with the 32-bit labels a
+  // grid then holds 4.1-4.8 bytes per cell between builds. The union-find
+  // forest of the provisional labels comes on top while labeling, which
+  // peaks at about 5.5 bytes per cell around the threshold with the
+  // periodic layout on one thread, 6 on several threads and 10 with the
+  // halo layout, which copies the labels.
+  void set_compact(bool val) { compact = val; }
+  // Find out which axes the domains span and wrap around while labeling.
+  // Only the union-find engine tracks the topology, on one thread with the
+  // halo layout, whatever the layout and thread settings are. update()
+  // then relabels the whole grid; occupy() does not track it.
+  void set_topology(bool val) { topology = val; }
   void build();
+  void build(double newP) { P = newP; build(); }
   void update(double newP);
 
+  // Remove all defects.
+  void clear();
+  // Add a defect at the empty cell i and merge it into the neighboring
+  // domains. Used for Newman-Ziff sweeps together with random_order().
+  void occupy(size_t i);
+  // Fill order with a random permutation of all cell indices.
+  void random_order(std::vector<size_t> &order);
+
+  // Buffers of dim.area() values for project(), one per column in x-major
+  // order. A null buffer is skipped.
+  struct Projection
+  {
+    // Fraction of occupied cells
+    double *grid = nullptr;
+    // Root label of the top-most occupied cell, 0 for an empty column
+    size_t *domains = nullptr;
+    // Sum of the domain spins of the occupied cells divided by Z
+    double *spins = nullptr;
+  };
+  // Compute all requested projections in one pass over the columns, on
+  // num_threads() threads over x. Only the first call and calls after the
+  // label forest has grown allocate, for the threads and the spin table.
+  void project(const Projection &out) const;
   void project_grid(std::vector<double> &out) const;
   void project_domains(std::vector<size_t> &out) const;
   void project_spins(std::vector<double> &out) const;
@@ -71,29 +240,50 @@ public:
     project_spins(out);
     return out;
   }
+  // Net spins of independent random spin assignments to the domains in
+  // label order, one per realization (see SpinSums). The spins depend on
+  // the seed and the stream of the grid.
+  const std::vector<int64_t>& net_spins(size_t realizations) const;
 
   GridType type() const { return grid_type; }
+  LabelingEngine labeling_engine() const { return engine; }
+  Layout storage_layout() const { return layout; }
+  size_t num_threads() const { return threads; }
+  bool is_compact() const { return compact; }
+  // Bytes allocated by the grid now, and the most at the peak of any
+  // labeling pass or now. The BFS engine is not meant for compact grids:
+  // its stack and visited bits take up to 20 bytes per cell.
+  size_t memory_usage() const;
+  size_t peak_memory_usage() const { return std::max(peak_memory, memory_usage()); }
   double density() const { return P; }
   const Dimensions& dimensions() const { return dim; }
-  size_t num_domains() const { return domains.size(); }
-  size_t max_domain_len() const {
-    size_t l = 0;
-    for (auto& it : domains)
-      if (it.size() > l) l = it.size();
-    return l;
-  }
-  double avg_domain_len() const {
-    size_t l = 0;
-    for (auto& it : domains)
-      l += it.size();
-    return (double)l / (double)domains.size();
-  }
+  // All domains with the indices of their cells, ordered by label.
+  const DomainTable& domains() const;
+  size_t num_domains() const { return domain_count; }
+  size_t max_domain_len() const { return largest_domain; }
+  // Axes that a domain spans, i.e. connects the faces at 0 and at the far
+  // end without using the periodic bonds
+  unsigned spanning_axes() const { return spanning; }
+  // Axes that a domain wraps around on the periodic lattice
+  unsigned wrapping_axes() const { return wrapping; }
+  double avg_domain_len() const { return (double)occupied / (double)domain_count; }
+  size_t second_domain_len() const;
+  // Domain size statistics, kept up to date by every labeling pass and by
+  // occupy() and update()
+  const ClusterStats& cluster_stats() const { return stats; }
 protected:
+  void reset_cells();
   void search_domains();
+  void rebuild_stats();
+  template<class Lattice> void search_domains_bfs();
+  template<class Lattice> void search_domains_union_find();
+  template<class Lattice> void search_domains_halo();
+  template<class Lattice> void search_domains_slabs();
+  template<typename F> void compact_labels(F provisional);
+  void reset_forest(size_t domains);
+  template<typename F> void add_defects(size_t target, F added);
+  template<class Lattice> void merge_cell(size_t i, size_t x, size_t y, size_t z);
 };
 
-std::forward_list<int> generate_neighbors_SC(int i, const Grid::Dimensions &dim);
-std::forward_list<int> generate_neighbors_Hex(int i, const Grid::Dimensions &dim);
-
 
 #endif
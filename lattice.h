@@ -0,0 +1,114 @@
+#ifndef LATTICE_H
+#define LATTICE_H
+
+#include <cstddef>
+#include <cstring>
+#include <utility>
+
+
+// Compile-time neighbor stencils of the supported lattices. A stencil is a
+// table of the offsets (dx, dy, dz) of all neighbors of a cell in row y.
+struct Offset
+{
+  int dx;
+  int dy;
+  int dz;
+};
+
+struct LatticeSC
+{
+  static constexpr int NUM_NEIGHBORS = 6;
+  static constexpr Offset offsets[NUM_NEIGHBORS] = {
+    {-1, 0, 0}, {1, 0, 0}, {0, -1, 0}, {0, 1, 0}, {0, 0, -1}, {0, 0, 1}
+  };
+  static constexpr const Offset* stencil(size_t) { return offsets; }
+};
+
+// Hexagonal layers stacked along z. Odd rows are shifted by half a cell in
+// x, so the neighbors in the rows y-1 and y+1 depend on the parity of y.
+struct LatticeHex
+{
+  static constexpr int NUM_NEIGHBORS = 8;
+  static constexpr Offset offsets[2][NUM_NEIGHBORS] = {
+    {{-1, 0, 0}, {1, 0, 0}, {0, -1, 0}, {1, -1, 0}, {0, 1, 0}, {1, 1, 0}, {0, 0, -1}, {0, 0, 1}},
+    {{-1, 0, 0}, {1, 0, 0}, {-1, -1, 0}, {0, -1, 0}, {-1, 1, 0}, {0, 1, 0}, {0, 0, -1}, {0, 0, 1}}
+  };
+  static constexpr const Offset* stencil(size_t y) { return offsets[y % 2]; }
+};
+
+// c+d wrapped periodically into [0, n)
+inline size_t wrap(size_t c, int d, size_t n)
+{
+  ptrdiff_t v = (ptrdiff_t)c + d;
+  if (v < 0) return v + n;
+  if (v >= (ptrdiff_t)n) return v - n;
+  return v;
+}
+
+template<class Lattice, class Dim, class F, size_t... K>
+inline void for_each_neighbor(size_t x, size_t y, size_t z, const Dim &dim, F &f,
+                              std::index_sequence<K...>)
+{
+  const Offset *s = Lattice::stencil(y);
+  (f((wrap(x, s[K].dx, dim.X)*dim.Y + wrap(y, s[K].dy, dim.Y))*dim.Z
+     + wrap(z, s[K].dz, dim.Z)), ...);
+}
+
+// Call f with the linear index of every neighbor of the cell (x,y,z) on a
+// periodic lattice. The loop over the stencil is unrolled at compile time.
+template<class Lattice, class Dim, class F>
+inline void for_each_neighbor(size_t x, size_t y, size_t z, const Dim &dim, F f)
+{
+  for_each_neighbor<Lattice>(x, y, z, dim, f,
+                             std::make_index_sequence<Lattice::NUM_NEIGHBORS>());
+}
+
+// Offset (dx, dy, dz) points to a cell that comes before the current one in
+// the linear (x, y, z) cell order.
+inline bool is_backward(const Offset &o)
+{
+  return o.dx < 0 || (o.dx == 0 && (o.dy < 0 || (o.dy == 0 && o.dz < 0)));
+}
+
+// Storage layout with one ghost layer on both sides of every dimension. The
+// ghost layers hold copies of the opposite boundary layers, so a neighbor
+// of any interior cell is a fixed linear offset away.
+struct HaloLayout
+{
+  size_t X, Y, Z;
+  size_t stride_x, stride_y;
+
+  template<class Dim>
+  explicit HaloLayout(const Dim &dim)
+    : X(dim.X), Y(dim.Y), Z(dim.Z), stride_x((dim.Y+2)*(dim.Z+2)), stride_y(dim.Z+2) {}
+
+  size_t volume() const { return (X+2)*stride_x; }
+  // Index of the interior cell (x,y,z)
+  size_t index(size_t x, size_t y, size_t z) const {
+    return (x+1)*stride_x + (y+1)*stride_y + z+1;
+  }
+  ptrdiff_t offset(const Offset &o) const {
+    return o.dx*(ptrdiff_t)stride_x + o.dy*(ptrdiff_t)stride_y + o.dz;
+  }
+
+  // Fill the ghost layers with the periodic images of the boundary layers.
+  // The dimensions are exchanged one after another, which also fills the
+  // ghost edges and corners.
+  template<typename T>
+  void exchange(T *data) const {
+    std::memcpy(data, data + X*stride_x, stride_x*sizeof(T));
+    std::memcpy(data + (X+1)*stride_x, data + stride_x, stride_x*sizeof(T));
+    for (size_t x = 0; x < X+2; ++x) {
+      T *plane = data + x*stride_x;
+      std::memcpy(plane, plane + Y*stride_y, stride_y*sizeof(T));
+      std::memcpy(plane + (Y+1)*stride_y, plane + stride_y, stride_y*sizeof(T));
+      for (size_t y = 0; y < Y+2; ++y) {
+        T *row = plane + y*stride_y;
+        row[0] = row[Z];
+        row[Z+1] = row[1];
+      }
+    }
+  }
+};
+
+#endif
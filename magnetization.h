@@ -0,0 +1,126 @@
+#ifndef MAGNETIZATION_H
+#define MAGNETIZATION_H
+
+#include <cstdint>
+#include <cstdlib>
+#include <vector>
+
+#include "philox.h"
+
+
+// Unit cell dimensions in cm and the moment of an occupied cell
+static const double UC_X = 3.7845e-8;
+static const double UC_Y = 3.7845e-8;
+static const double UC_Z = 9.5143e-8;
+static const double MU_B = 9.274e-21; // emu
+static const int MU_B_PER_CELL = 1;
+
+// Stream bit of the spin realizations, so they are independent of the
+// defects and of the spins of Grid::project_spins()
+static const uint64_t MOMENT_STREAM = uint64_t(1) << 62;
+
+
+// Net moments of many independent random spin assignments to the same
+// domains. Every domain has a spin of +1 or -1 in every realization, and
+// the net spin of a realization is the sum of spin times size over all
+// domains. Labeling is the expensive part, so one labeling is reused for
+// many realizations.
+//
+// The domains are added one by one in a fixed order and reduced in blocks
+// of 64: one random word holds the spins of a block in one realization,
+// and the net spin of the block is 2 * (sizes with the bit set) - (block
+// size), a masked sum that the compiler vectorizes. The spins of domain d
+// in realization r only depend on (seed, stream, d, r).
+class SpinSums
+{
+public:
+  static const size_t BLOCK = 64;
+
+  void reset(uint64_t seed, uint64_t stream, size_t realizations) {
+    this->seed = seed;
+    this->stream = stream | MOMENT_STREAM;
+    sums.assign(realizations, 0);
+    block = 0;
+    buffered = 0;
+  }
+  // Add the next domain
+  void add(uint64_t size) {
+    if (sums.empty()) return;
+    sizes[buffered++] = size;
+    if (buffered == BLOCK) flush();
+  }
+  // Reduce the last, partial block after the last domain
+  void finish() {
+    if (buffered > 0) flush();
+  }
+  size_t realizations() const { return sums.size(); }
+  // Net spin of every realization over all domains, after finish()
+  const std::vector<int64_t>& net_spins() const { return sums; }
+
+private:
+  void flush() {
+    uint64_t total = 0;
+    for (size_t i = 0; i < buffered; ++i) total += sizes[i];
+    for (size_t i = buffered; i < BLOCK; ++i) sizes[i] = 0;
+    // One Philox block holds the words of two realizations
+    size_t pairs = (sums.size() + 1) / 2;
+    for (size_t p = 0; p < pairs; ++p) {
+      uint64_t c = block*pairs + p;
+      PhiloxEngine::Block r = PhiloxEngine::generate(
+        seed, {uint32_t(c), uint32_t(c >> 32), uint32_t(stream), uint32_t(stream >> 32)});
+      uint64_t words[2] = {(uint64_t(r[1]) << 32) | r[0], (uint64_t(r[3]) << 32) | r[2]};
+      for (size_t j = 0; j < 2 && 2*p + j < sums.size(); ++j) {
+        uint64_t up = 0;
+        for (size_t i = 0; i < BLOCK; ++i) up += sizes[i] & (uint64_t(0) - ((words[j] >> i) & 1));
+        sums[2*p + j] += 2*(int64_t)up - (int64_t)total;
+      }
+    }
+    block++;
+    buffered = 0;
+  }
+
+  uint64_t seed = 0;
+  uint64_t stream = 0;
+  std::vector<int64_t> sums;
+  uint64_t sizes[BLOCK];
+  uint64_t block = 0;
+  size_t buffered = 0;
+};
+
+// Moment of a lattice in emu and its magnetization in emu/cm^3 for the net
+// spin of a realization
+inline double net_moment(int64_t net_spin) {
+  return MU_B * MU_B_PER_CELL * (double)std::llabs(net_spin);
+}
+inline double net_magnetization(int64_t net_spin, size_t cells) {
+  return net_moment(net_spin) / ((double)cells * UC_X * UC_Y * UC_Z);
+}
+
+// Averages of a set of realizations
+struct MomentSample
+{
+  double moment = 0.0;
+  double moment_sq = 0.0;
+  double magnetization = 0.0;
+  double magnetization_sq = 0.0;
+};
+
+inline MomentSample moment_sample(const std::vector<int64_t> &net_spins, size_t cells) {
+  MomentSample s;
+  if (net_spins.empty()) return s;
+  for (int64_t n : net_spins) {
+    double m = net_moment(n), M = net_magnetization(n, cells);
+    s.moment += m;
+    s.moment_sq += m*m;
+    s.magnetization += M;
+    s.magnetization_sq += M*M;
+  }
+  double R = (double)net_spins.size();
+  s.moment /= R;
+  s.moment_sq /= R;
+  s.magnetization /= R;
+  s.magnetization_sq /= R;
+  return s;
+}
+
+#endif
@@ -0,0 +1,92 @@
+#ifndef PHILOX_H
+#define PHILOX_H
+
+#include <array>
+#include <cstdint>
+
+
+// Philox4x32-10 counter-based generator (Salmon et al., "Parallel random
+// numbers: as easy as 1, 2, 3", SC'11). A keyed bijection maps a 128-bit
+// counter to 128 random bits, so every position of every stream can be
+// computed directly, without shared state.
+//
+// A stream is addressed by (seed, stream); the counter of block b of the
+// stream is (b lo, b hi, stream lo, stream hi) and the key is the seed.
+// sim uses stream_id(P index, grid index), so the defects of a grid do not
+// depend on which thread or process builds it.
+class PhiloxEngine
+{
+public:
+  typedef uint32_t result_type;
+  typedef std::array<uint32_t, 4> Block;
+
+  explicit PhiloxEngine(uint64_t seed = 0, uint64_t stream = 0) { this->seed(seed, stream); }
+
+  void seed(uint64_t seed, uint64_t stream = 0) {
+    key = seed;
+    this->stream = stream;
+    pos = 0;
+    block_index = ~uint64_t(0);
+  }
+  // Skip n outputs in O(1)
+  void discard(uint64_t n) { pos += n; }
+  // Number of outputs drawn since seed(). Together with the seed and the
+  // stream it is the complete state of the engine.
+  uint64_t position() const { return pos; }
+
+  result_type operator()() {
+    uint64_t b = pos / 4;
+    if (b != block_index) {
+      block = generate(key, {uint32_t(b), uint32_t(b >> 32), uint32_t(stream), uint32_t(stream >> 32)});
+      block_index = b;
+    }
+    return block[pos++ % 4];
+  }
+  // Uniform integer in [0, n) (Lemire's multiply-and-reject method)
+  uint64_t uniform(uint64_t n) {
+    unsigned __int128 m = (unsigned __int128)next64() * n;
+    if ((uint64_t)m < n) {
+      uint64_t threshold = -n % n;
+      while ((uint64_t)m < threshold) m = (unsigned __int128)next64() * n;
+    }
+    return m >> 64;
+  }
+  uint64_t next64() {
+    uint64_t lo = (*this)();
+    return (uint64_t((*this)()) << 32) | lo;
+  }
+
+  static constexpr result_type min() { return 0; }
+  static constexpr result_type max() { return UINT32_MAX; }
+
+  static uint64_t stream_id(uint32_t p_index, uint32_t grid_index) {
+    return (uint64_t(p_index) << 32) | grid_index;
+  }
+  // 64 random bits at position i of a stream, e.g. the value of site i
+  static uint64_t at(uint64_t seed, uint64_t stream, uint64_t i) {
+    Block r = generate(seed, {uint32_t(i), uint32_t(i >> 32), uint32_t(stream), uint32_t(stream >> 32)});
+    return (uint64_t(r[1]) << 32) | r[0];
+  }
+
+  static Block generate(uint64_t key, Block ctr) {
+    uint32_t k0 = uint32_t(key), k1 = uint32_t(key >> 32);
+    for (int round = 0; round < 10; ++round) {
+      uint64_t p0 = uint64_t(0xD2511F53) * ctr[0];
+      uint64_t p1 = uint64_t(0xCD9E8D57) * ctr[2];
+      ctr = {uint32_t(p1 >> 32) ^ ctr[1] ^ k0, uint32_t(p1),
+             uint32_t(p0 >> 32) ^ ctr[3] ^ k1, uint32_t(p0)};
+      k0 += 0x9E3779B9;
+      k1 += 0xBB67AE85;
+    }
+    return ctr;
+  }
+
+private:
+  uint64_t key;
+  uint64_t stream;
+  uint64_t pos;
+  uint64_t block_index;
+  Block block;
+};
+
+#endif
@@ -0,0 +1,73 @@
+#ifndef RASTER_H
+#define RASTER_H
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <future>
+#include <vector>
+
+
+// Pixels of an image in memory, 32 bits each in the 0x00RRGGBB format of a
+// Cairo RGB24 surface. Rows are stride bytes apart.
+struct PixelBuffer
+{
+  unsigned char *data;
+  int width;
+  int height;
+  int stride;
+};
+
+// Color of a domain label: 24 bits of a 64-bit mix of the label. Empty
+// columns are black.
+inline uint32_t label_color(size_t label)
+{
+  if (label == 0) return 0;
+  uint64_t h = label * 0x9E3779B97F4A7C15ull;
+  h = (h ^ (h >> 30)) * 0xBF58476D1CE4E5B9ull;
+  h = (h ^ (h >> 27)) * 0x94D049BB133111EBull;
+  h ^= h >> 31;
+  return (uint32_t)h & 0xFFFFFF;
+}
+
+// Write the cells of a rows x cols table of labels into image as cell_W x
+// cell_H rectangles starting at (off_X, off_Y), with the columns along the
+// image x axis. The rectangles are clipped to the image on all sides, so
+// the offsets may be negative. Every cell row is rendered once as pixel
+// spans and copied to its other pixel rows. The cell rows are split across
+// threads.
+inline void rasterize_cells(const PixelBuffer &image, const std::vector<size_t> &labels,
+                            size_t rows, size_t cols, int off_X, int off_Y,
+                            int cell_W, int cell_H, size_t threads)
+{
+  if (cell_W <= 0 || cell_H <= 0) return;
+  // First pixel and cell column inside the image
+  long x_begin = std::max(off_X, 0);
+  size_t first = off_X < 0 ? (size_t)(-(long)off_X / cell_W) : 0;
+  size_t num_threads = std::max<size_t>(1, std::min(threads, rows));
+  auto band = [&](size_t t) {
+    for (size_t xx = rows*t / num_threads, end = rows*(t+1) / num_threads; xx < end; ++xx) {
+      long y0 = off_Y + (long)xx*cell_H;
+      long y1 = std::min<long>(y0 + cell_H, image.height);
+      y0 = std::max<long>(y0, 0);
+      if (y0 >= y1) continue;
+      uint32_t *row = reinterpret_cast<uint32_t*>(image.data + y0*image.stride);
+      long x = x_begin;
+      for (size_t yy = first; yy < cols && x < image.width; ++yy) {
+        uint32_t c = label_color(labels[xx*cols + yy]);
+        long span_end = std::min<long>(off_X + (long)(yy + 1)*cell_W, image.width);
+        for (; x < span_end; ++x) row[x] = c;
+      }
+      for (long y = y0 + 1; y < y1; ++y)
+        memcpy(image.data + y*image.stride + x_begin*sizeof(uint32_t), row + x_begin,
+               (x - x_begin)*sizeof(uint32_t));
+    }
+  };
+  std::vector<std::future<void>> tasks;
+  for (size_t t = 1; t < num_threads; ++t) tasks.push_back(std::async(std::launch::async, band, t));
+  band(0);
+  for (auto &task : tasks) task.get();
+}
+
+#endif
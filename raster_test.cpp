@@ -0,0 +1,55 @@
+#include <cstdint>
+#include <iostream>
+#include <vector>
+
+#include "philox.h"
+#include "raster.h"
+
+using namespace std;
+
+// Fill every cell as its own clipped rectangle, the way draw_domains did
+// with Cairo before it wrote the pixels itself
+static void fill_cells(const PixelBuffer &image, const vector<size_t> &labels,
+                       size_t rows, size_t cols, int off_X, int off_Y, int cell_W, int cell_H)
+{
+  for (size_t xx = 0; xx < rows; ++xx)
+    for (size_t yy = 0; yy < cols; ++yy)
+      for (long y = off_Y + (long)xx*cell_H; y < off_Y + (long)(xx+1)*cell_H; ++y)
+        for (long x = off_X + (long)yy*cell_W; x < off_X + (long)(yy+1)*cell_W; ++x)
+          if (x >= 0 && x < image.width && y >= 0 && y < image.height)
+            reinterpret_cast<uint32_t*>(image.data + y*image.stride)[x] =
+              label_color(labels[xx*cols + yy]);
+}
+
+// The rasterizer must give the same pixels as the per-cell fills for any
+// geometry, including cells that stick out of the image on any side, and
+// must leave the pixels outside the cells and the row padding alone.
+int main()
+{
+  const uint32_t BACKGROUND = 0xE6E6E6;
+  PhiloxEngine rng(1);
+  int failed = 0;
+  for (int it = 0; it < 500; ++it) {
+    int width = 1 + rng.uniform(120), height = 1 + rng.uniform(90);
+    int stride = 4*(width + rng.uniform(4));
+    size_t rows = 1 + rng.uniform(40), cols = 1 + rng.uniform(40);
+    int cell_W = rng.uniform(6), cell_H = rng.uniform(6);
+    int off_X = (int)rng.uniform(160) - 60, off_Y = (int)rng.uniform(120) - 40;
+    size_t threads = 1 + rng.uniform(4);
+    vector<size_t> labels(rows*cols);
+    for (auto &l : labels) l = rng.uniform(4) == 0 ? 0 : 1 + rng.uniform(50);
+
+    vector<uint32_t> got(stride/4*height, BACKGROUND), want(got);
+    PixelBuffer got_image = {reinterpret_cast<unsigned char*>(got.data()), width, height, stride};
+    PixelBuffer want_image = {reinterpret_cast<unsigned char*>(want.data()), width, height, stride};
+    rasterize_cells(got_image, labels, rows, cols, off_X, off_Y, cell_W, cell_H, threads);
+    fill_cells(want_image, labels, rows, cols, off_X, off_Y, cell_W, cell_H);
+    if (got != want) {
+      cerr << "image " << width << "x" << height << ", " << rows << "x" << cols << " cells of "
+           << cell_W << "x" << cell_H << " at (" << off_X << "," << off_Y << "): pixels differ"
+           << endl;
+      failed = 1;
+    }
+  }
+  return failed;
+}
@@ -0,0 +1,92 @@
+#include "scheduler.h"
+
+using namespace std;
+
+static thread_local int current_worker = -1;
+
+
+Scheduler::Scheduler(size_t num_threads)
+{
+  if (num_threads == 0) num_threads = thread::hardware_concurrency();
+  if (num_threads == 0) num_threads = 1;
+  for (size_t w = 0; w < num_threads; ++w)
+    queues.emplace_back(new Queue());
+  for (size_t w = 0; w < num_threads; ++w)
+    workers.emplace_back(&Scheduler::run, this, w);
+}
+
+Scheduler::~Scheduler()
+{
+  wait();
+  {
+    lock_guard<std::mutex> lock(mutex);
+    stop = true;
+  }
+  work_available.notify_all();
+  for (auto &t : workers) t.join();
+}
+
+int Scheduler::worker_index()
+{
+  return current_worker;
+}
+
+void Scheduler::submit(Task task)
+{
+  // Tasks submitted by a worker go to its own queue, all others are spread
+  // round robin.
+  size_t w;
+  {
+    lock_guard<std::mutex> lock(mutex);
+    w = current_worker >= 0 ? current_worker : next_queue++ % queues.size();
+    unfinished++;
+    queued++;
+  }
+  {
+    lock_guard<std::mutex> lock(queues[w]->mutex);
+    queues[w]->tasks.push_back(move(task));
+  }
+  work_available.notify_one();
+}
+
+void Scheduler::wait()
+{
+  unique_lock<std::mutex> lock(mutex);
+  all_done.wait(lock, [this] { return unfinished == 0; });
+}
+
+// Take the oldest task of the worker's own queue, or steal the oldest task
+// of another queue.
+bool Scheduler::take(size_t worker, Task &task)
+{
+  for (size_t k = 0; k < queues.size(); ++k) {
+    Queue &q = *queues[(worker + k) % queues.size()];
+    lock_guard<std::mutex> lock(q.mutex);
+    if (q.tasks.empty()) continue;
+    task = move(q.tasks.front());
+    q.tasks.pop_front();
+    return true;
+  }
+  return false;
+}
+
+void Scheduler::run(size_t worker)
+{
+  current_worker = worker;
+  while (true) {
+    Task task;
+    if (take(worker, task)) {
+      {
+        lock_guard<std::mutex> lock(mutex);
+        queued--;
+      }
+      task();
+      lock_guard<std::mutex> lock(mutex);
+      if (--unfinished == 0) all_done.notify_all();
+      continue;
+    }
+    unique_lock<std::mutex> lock(mutex);
+    work_available.wait(lock, [this] { return stop || queued > 0; });
+    if (stop && queued == 0) return;
+  }
+}
@@ -0,0 +1,56 @@
+#ifndef SCHEDULER_H
+#define SCHEDULER_H
+
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+
+// Thread pool with one task queue per worker. Workers run the tasks of their
+// own queue in submission order and steal from the other queues when their
+// own queue is empty, so a few slow tasks do not hold up the rest.
+class Scheduler
+{
+public:
+  typedef std::function<void()> Task;
+
+  // With num_threads = 0, one worker per hardware thread is started.
+  explicit Scheduler(size_t num_threads = 0);
+  // Waits for all submitted tasks.
+  ~Scheduler();
+
+  void submit(Task task);
+  // Block until all submitted tasks have finished.
+  void wait();
+
+  size_t size() const { return queues.size(); }
+  // Index of the calling worker in [0, size()), or -1 outside of the pool.
+  static int worker_index();
+
+private:
+  struct Queue
+  {
+    std::mutex mutex;
+    std::deque<Task> tasks;
+  };
+
+  bool take(size_t worker, Task &task);
+  void run(size_t worker);
+
+  std::vector<std::unique_ptr<Queue>> queues;
+  std::vector<std::thread> workers;
+
+  std::mutex mutex;
+  std::condition_variable work_available;
+  std::condition_variable all_done;
+  size_t queued = 0;
+  size_t unfinished = 0;
+  size_t next_queue = 0;
+  bool stop = false;
+};
+
+#endif
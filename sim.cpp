@@ -1,12 +1,17 @@
+#include <algorithm>
 #include <cassert>
 #include <chrono>
+#include <cmath>
+#include <condition_variable>
+#include <cstdio>
 #include <cstring>
 #include <functional>
-#include <future>
 #include <fstream>
 #include <iostream>
 #include <list>
+#include <map>
 #include <memory>
+#include <mutex>
 #include <random>
 #include <set>
 #include <string>
@@ -14,8 +19,6 @@
 
 using namespace std;
 
-static const int Nthreads = 8;
-
 static const bool DEBUG = false;
 static const bool INFO = false;
 
@@ -27,7 +30,11 @@ static const bool INFO = false;
   if (!DEBUG) {} \
   else cerr
 
+#include "accumulator.h"
+#include "columnar.h"
 #include "grid.h"
+#include "scheduler.h"
+#include "streaming.h"
 
 struct SimulationParams
 {
@@ -36,155 +43,1131 @@ struct SimulationParams
   double P;
   int Niter;
   int Ngrids;
-  int seed;
+  uint64_t seed;
+  // Random spin assignments per labeling for the moment and magnetization
+  size_t spins;
   Grid::GridType grid_type;
 };
 
 struct SimulationResults
 {
   double P = 0.0;
+  size_t num_grids = 0;
   double avg_num_domains = 0.0;
   double std_num_domains = 0.0;
+  double sem_num_domains = 0.0;
   double avg_max_domain_size = 0.0;
   double std_max_domain_size = 0.0;
+  double sem_max_domain_size = 0.0;
   double avg_mean_domain_size = 0.0;
   double std_mean_domain_size = 0.0;
+  double sem_mean_domain_size = 0.0;
+  double avg_second_domain_size = 0.0;
+  double std_second_domain_size = 0.0;
+  double sem_second_domain_size = 0.0;
+  double avg_susceptibility = 0.0;
+  double std_susceptibility = 0.0;
+  double sem_susceptibility = 0.0;
+  // Domains per size bin of ClusterStats, summed over all grids
+  double cluster_sizes[ClusterStats::NUM_BINS] = {0};
+  double avg_spanning = 0.0;
+  double sem_spanning = 0.0;
+  double avg_wrapping = 0.0;
+  double sem_wrapping = 0.0;
+  // Net moment in emu and magnetization in emu/cm^3 with random domain
+  // spins. The standard deviation is the spread of single spin
+  // assignments over all grids, the standard error that of the average.
   double avg_moment = 0.0;
   double std_moment = 0.0;
+  double sem_moment = 0.0;
   double avg_magnetization = 0.0;
   double std_magnetization = 0.0;
+  double sem_magnetization = 0.0;
+};
+
+// Observables of one grid. spanning and wrapping are 1 if a domain spans or
+// wraps around the lattice in x or y, and 0 otherwise or if the topology is
+// not tracked. cluster_sizes holds the domains per size bin. The moment
+// and magnetization are averages over the spin assignments, the *_sq ones
+// the averages of their squares.
+struct Sample
+{
+  double num_domains;
+  double max_domain_size;
+  double mean_domain_size;
+  double second_domain_size;
+  double susceptibility;
+  double moment;
+  double moment_sq;
+  double magnetization;
+  double magnetization_sq;
+  double spanning;
+  double wrapping;
+  double cluster_sizes[ClusterStats::NUM_BINS];
+
+  // Add w times the sample s, e.g. for ensemble averages
+  void add(double w, const Sample &s) {
+    num_domains += w*s.num_domains;
+    max_domain_size += w*s.max_domain_size;
+    mean_domain_size += w*s.mean_domain_size;
+    second_domain_size += w*s.second_domain_size;
+    susceptibility += w*s.susceptibility;
+    moment += w*s.moment;
+    moment_sq += w*s.moment_sq;
+    magnetization += w*s.magnetization;
+    magnetization_sq += w*s.magnetization_sq;
+    spanning += w*s.spanning;
+    wrapping += w*s.wrapping;
+    for (int b = 0; b < ClusterStats::NUM_BINS; ++b) cluster_sizes[b] += w*s.cluster_sizes[b];
+  }
+};
+
+// Accumulated observables of a set of grids
+struct Observables
+{
+  Accumulator num_domains;
+  Accumulator max_domain_size;
+  Accumulator mean_domain_size;
+  Accumulator second_domain_size;
+  Accumulator susceptibility;
+  Accumulator moment;
+  Accumulator moment_sq;
+  Accumulator magnetization;
+  Accumulator magnetization_sq;
+  Accumulator spanning;
+  Accumulator wrapping;
+  double cluster_sizes[ClusterStats::NUM_BINS] = {0};
+
+  void add(const Sample &s) {
+    num_domains.add(s.num_domains);
+    max_domain_size.add(s.max_domain_size);
+    mean_domain_size.add(s.mean_domain_size);
+    second_domain_size.add(s.second_domain_size);
+    susceptibility.add(s.susceptibility);
+    moment.add(s.moment);
+    moment_sq.add(s.moment_sq);
+    magnetization.add(s.magnetization);
+    magnetization_sq.add(s.magnetization_sq);
+    spanning.add(s.spanning);
+    wrapping.add(s.wrapping);
+    for (int b = 0; b < ClusterStats::NUM_BINS; ++b) cluster_sizes[b] += s.cluster_sizes[b];
+  }
+  void merge(const Observables &o) {
+    num_domains.merge(o.num_domains);
+    max_domain_size.merge(o.max_domain_size);
+    mean_domain_size.merge(o.mean_domain_size);
+    second_domain_size.merge(o.second_domain_size);
+    susceptibility.merge(o.susceptibility);
+    moment.merge(o.moment);
+    moment_sq.merge(o.moment_sq);
+    magnetization.merge(o.magnetization);
+    magnetization_sq.merge(o.magnetization_sq);
+    spanning.merge(o.spanning);
+    wrapping.merge(o.wrapping);
+    for (int b = 0; b < ClusterStats::NUM_BINS; ++b) cluster_sizes[b] += o.cluster_sizes[b];
+  }
+};
+
+// Averages, standard deviations and standard errors of the observables
+void summarize(SimulationResults &res, const Observables &obs)
+{
+  res.avg_num_domains = obs.num_domains.mean();
+  res.std_num_domains = obs.num_domains.std();
+  res.sem_num_domains = obs.num_domains.sem();
+  res.avg_max_domain_size = obs.max_domain_size.mean();
+  res.std_max_domain_size = obs.max_domain_size.std();
+  res.sem_max_domain_size = obs.max_domain_size.sem();
+  res.avg_mean_domain_size = obs.mean_domain_size.mean();
+  res.std_mean_domain_size = obs.mean_domain_size.std();
+  res.sem_mean_domain_size = obs.mean_domain_size.sem();
+  res.avg_second_domain_size = obs.second_domain_size.mean();
+  res.std_second_domain_size = obs.second_domain_size.std();
+  res.sem_second_domain_size = obs.second_domain_size.sem();
+  res.avg_susceptibility = obs.susceptibility.mean();
+  res.std_susceptibility = obs.susceptibility.std();
+  res.sem_susceptibility = obs.susceptibility.sem();
+  res.avg_moment = obs.moment.mean();
+  res.std_moment = sqrt(max(0.0, obs.moment_sq.mean() - res.avg_moment*res.avg_moment));
+  res.sem_moment = obs.moment.sem();
+  res.avg_magnetization = obs.magnetization.mean();
+  res.std_magnetization = sqrt(max(0.0, obs.magnetization_sq.mean()
+                                   - res.avg_magnetization*res.avg_magnetization));
+  res.sem_magnetization = obs.magnetization.sem();
+  copy(obs.cluster_sizes, obs.cluster_sizes + ClusterStats::NUM_BINS, res.cluster_sizes);
+  res.avg_spanning = obs.spanning.mean();
+  res.sem_spanning = obs.spanning.sem();
+  res.avg_wrapping = obs.wrapping.mean();
+  res.sem_wrapping = obs.wrapping.sem();
+}
+
+// Checkpoint of a run: a log of the samples of all finished (P, grid)
+// tasks. The file starts with a line that identifies the run parameters,
+// followed by binary records that are flushed as soon as a task finishes.
+// A run that is restarted with the same parameters reads the records back
+// and only runs the missing tasks.
+class TaskLog
+{
+public:
+  struct Record
+  {
+    uint32_t k;
+    uint32_t g;
+    Sample sample;
+  };
+
+  ~TaskLog() {
+    if (file) fclose(file);
+  }
+
+  // Open or create the log at path. The records of an existing log are
+  // returned in records. Returns false if the log cannot be opened or
+  // belongs to a run with other parameters.
+  bool open(const string &path, const string &key, vector<Record> &records) {
+    string header = "PERCLOG4 " + key + "\n";
+    records.clear();
+    file = fopen(path.c_str(), "r+b");
+    if (!file) {
+      file = fopen(path.c_str(), "w+b");
+      if (!file) return false;
+      fwrite(header.data(), 1, header.size(), file);
+      return fflush(file) == 0;
+    }
+    string existing(header.size(), '\0');
+    if (fread(&existing[0], 1, header.size(), file) != header.size() || existing != header)
+      return false;
+    Record r;
+    while (fread(&r, sizeof(r), 1, file) == 1) records.push_back(r);
+    // Drop a record that was cut off by a crash
+    fseek(file, header.size() + records.size()*sizeof(Record), SEEK_SET);
+    return true;
+  }
+
+  void append(const Record &r) {
+    lock_guard<mutex> lock(m);
+    fwrite(&r, sizeof(r), 1, file);
+    fflush(file);
+  }
+
+private:
+  mutex m;
+  FILE *file = nullptr;
+};
+
+// Reduction of the per-grid samples of all P steps. The grids are reduced
+// in blocks of consecutive grids: the samples of a block are kept until the
+// block is complete and then added in grid order, and the complete blocks
+// are merged in block order. The results thus do not depend on the order in
+// which the tasks finish. The samples are written to the output as their
+// block is merged, so the output does not either. The main thread waits
+// for the P steps in order.
+//
+// With a target error, a P step is finished as soon as the relative standard
+// error of every average is at most the target after a merged block. The
+// blocks are then smaller, so that a step can stop after a few grids.
+// Blocks that finish later are ignored, so the results still only depend on
+// the seed.
+static const int BLOCK_GRIDS = 64;
+static const int ADAPTIVE_BLOCK_GRIDS = 8;
+// Blocks per P step that run ahead of the merged blocks with a target error
+static const size_t ADAPTIVE_LOOKAHEAD = 4;
+
+class ResultTable
+{
+public:
+  // The rows of the P steps are created when a step is first used, so
+  // that a refined run only holds the steps that it samples
+  ResultTable(size_t Psteps, int Ngrids, int block_grids = BLOCK_GRIDS)
+    : Psteps(Psteps), Ngrids(Ngrids), block_grids(block_grids),
+      num_row_blocks((Ngrids + block_grids - 1) / block_grids) {}
+
+  // Samples of finished tasks are also appended to log, if there is one
+  void set_log(TaskLog *val) { log = val; }
+  // Relative standard error that finishes a P step, or 0 to run all grids
+  void set_target(double val) { target = val; }
+  // Samples are also written as rows of the table samples of output, with
+  // the spanning and wrapping columns if topology is set
+  void set_output(columnar::Writer *val, size_t samples, bool topology) {
+    output = val;
+    output_table = samples;
+    output_topology = topology;
+  }
+
+  // Record the sample of the finished task (k, g). Samples of finished P
+  // steps are dropped.
+  void record(size_t k, int g, const Sample &s) {
+    if (complete(k)) return;
+    if (log) log->append({(uint32_t)k, (uint32_t)g, s});
+    add(k, g, s);
+  }
+  // Record a task from a checkpoint
+  void restore(const TaskLog::Record &r) { add(r.k, r.g, r.sample); }
+  // Restore the complete block b of the P step k, e.g. from a shard
+  void restore_block(size_t k, size_t b, const Observables &obs) {
+    lock_guard<mutex> lock(m);
+    Row &row = get_row(k);
+    Block &block = row.blocks[b];
+    if (row.done || block.remaining == 0) return;
+    row.remaining -= block.remaining;
+    block.remaining = 0;
+    block.obs = obs;
+    merge_blocks(k, row);
+    if (row.remaining == 0) row.done = true;
+    if (row.done) cv.notify_all();
+  }
+  // Call f(k, b, obs) for every complete block b of every P step k
+  template<typename F>
+  void for_each_block(F f) {
+    lock_guard<mutex> lock(m);
+    for (auto &r : rows)
+      for (size_t b = 0; b < r.second.blocks.size(); ++b)
+        if (r.second.blocks[b].remaining == 0) f(r.first, b, r.second.blocks[b].obs);
+  }
+  bool complete(size_t k) {
+    lock_guard<mutex> lock(m);
+    return get_row(k).done;
+  }
+  size_t num_blocks() const { return num_row_blocks; }
+  int grids_per_block() const { return block_grids; }
+  // Next block of the P step k to run, or -1 if the step needs no more
+  // blocks for now. At most lookahead blocks run ahead of the merged ones.
+  int next_block(size_t k, size_t lookahead) {
+    lock_guard<mutex> lock(m);
+    Row &row = get_row(k);
+    while (row.issued < row.blocks.size() && row.blocks[row.issued].remaining == 0) row.issued++;
+    if (row.done || row.issued == row.blocks.size() || row.issued >= row.next_block + lookahead)
+      return -1;
+    return row.issued++;
+  }
+
+  SimulationResults wait(size_t k, double P) {
+    unique_lock<mutex> lock(m);
+    Row &row = get_row(k);
+    cv.wait(lock, [&] { return row.done; });
+    SimulationResults res;
+    res.P = P;
+    res.num_grids = row.total.num_domains.count();
+    summarize(res, row.total);
+    return res;
+  }
+
+private:
+  struct Block
+  {
+    vector<Sample> samples;
+    int remaining;
+    Observables obs;
+  };
+  struct Row
+  {
+    vector<Block> blocks;
+    size_t next_block = 0;
+    Observables total;
+    int remaining;
+    // Blocks handed out by next_block()
+    size_t issued = 0;
+    bool done;
+  };
+
+  int block_size(size_t b) const { return min<int>(block_grids, Ngrids - b*block_grids); }
+  // The row of the P step k, created on first use. Call with m locked.
+  Row& get_row(size_t k) {
+    auto it = rows.find(k);
+    if (it != rows.end()) return it->second;
+    Row &row = rows[k];
+    row.blocks.resize(num_row_blocks);
+    for (size_t b = 0; b < num_row_blocks; ++b) row.blocks[b].remaining = block_size(b);
+    row.remaining = Ngrids;
+    row.done = Ngrids == 0;
+    return row;
+  }
+
+  void write(size_t k, int g, const Sample &s) {
+    if (!output) return;
+    double P = (double)k/(double)Psteps;
+    vector<columnar::Value> row = {k, P, g, s.num_domains, s.max_domain_size, s.mean_domain_size,
+                                   s.second_domain_size, s.susceptibility, s.moment,
+                                   s.magnetization};
+    if (output_topology) row.insert(row.end(), {s.spanning, s.wrapping});
+    output->append(output_table, row);
+  }
+  void add(size_t k, int g, const Sample &s) {
+    lock_guard<mutex> lock(m);
+    Row &row = get_row(k);
+    if (row.done) return;
+    Block &block = row.blocks[g / block_grids];
+    if (block.samples.empty()) block.samples.resize(block_grids);
+    block.samples[g % block_grids] = s;
+    if (--block.remaining == 0) {
+      for (int j = 0; j < block_size(g / block_grids); ++j) block.obs.add(block.samples[j]);
+      // The samples are written when the block is merged
+      if (!output) vector<Sample>().swap(block.samples);
+      merge_blocks(k, row);
+    }
+    if (--row.remaining == 0) row.done = true;
+    if (row.done) cv.notify_all();
+  }
+  void merge_blocks(size_t k, Row &row) {
+    while (!row.done && row.next_block < row.blocks.size()
+           && row.blocks[row.next_block].remaining == 0) {
+      size_t b = row.next_block++;
+      Block &block = row.blocks[b];
+      for (size_t j = 0; j < block.samples.size() && (int)j < block_size(b); ++j)
+        write(k, b*block_grids + j, block.samples[j]);
+      vector<Sample>().swap(block.samples);
+      row.total.merge(block.obs);
+      if (target > 0.0 && converged(row.total)) row.done = true;
+    }
+  }
+  // The relative standard error of every average that is printed is at
+  // most the target
+  bool converged(const Observables &obs) const {
+    for (const Accumulator *a : {&obs.num_domains, &obs.max_domain_size, &obs.mean_domain_size,
+                                 &obs.second_domain_size, &obs.susceptibility, &obs.moment,
+                                 &obs.magnetization, &obs.spanning, &obs.wrapping})
+      if (a->count() < 2 || a->sem() > target*fabs(a->mean())) return false;
+    return true;
+  }
+
+  size_t Psteps;
+  int Ngrids;
+  int block_grids;
+  size_t num_row_blocks;
+  double target = 0.0;
+  mutex m;
+  condition_variable cv;
+  map<size_t, Row> rows;
+  TaskLog *log = nullptr;
+  columnar::Writer *output = nullptr;
+  size_t output_table = 0;
+  bool output_topology = false;
+};
+
+// Observables of a labeled grid
+template<class G>
+Sample domain_sample(const G &grid)
+{
+  const ClusterStats &stats = grid.cluster_stats();
+  Sample s = {};
+  s.num_domains = grid.num_domains();
+  s.max_domain_size = grid.max_domain_len();
+  s.mean_domain_size = grid.num_domains() ? grid.avg_domain_len() : 0.0;
+  s.second_domain_size = grid.second_domain_len();
+  s.susceptibility = stats.susceptibility();
+  for (int b = 0; b < ClusterStats::NUM_BINS; ++b) s.cluster_sizes[b] = stats.bin_count(b);
+  return s;
+}
+
+void set_moments(Sample &s, const vector<int64_t> &net_spins, size_t cells)
+{
+  MomentSample m = moment_sample(net_spins, cells);
+  s.moment = m.moment;
+  s.moment_sq = m.moment_sq;
+  s.magnetization = m.magnetization;
+  s.magnetization_sq = m.magnetization_sq;
+}
+
+// Observables of a labeled grid, with the moments of the given number of
+// random spin assignments to its domains
+Sample sample(const Grid &grid, size_t spins)
+{
+  const unsigned lateral = Grid::AXIS_X | Grid::AXIS_Y;
+  Sample s = domain_sample(grid);
+  s.spanning = grid.spanning_axes() & lateral ? 1.0 : 0.0;
+  s.wrapping = grid.wrapping_axes() & lateral ? 1.0 : 0.0;
+  if (spins > 0) set_moments(s, grid.net_spins(spins), grid.dimensions().volume());
+  return s;
+}
+
+// The spins of a streamed grid are summed up while it is labeled
+Sample sample(const StreamingGrid &grid, size_t)
+{
+  Sample s = domain_sample(grid);
+  set_moments(s, grid.net_spins(), grid.dimensions().volume());
+  return s;
+}
+
+// Place the defects of grid g at step k and label the grid
+void build_grid(Grid &grid, const SimulationParams &params, size_t k, int g)
+{
+  grid.set_seed(params.seed);
+  grid.set_stream(PhiloxEngine::stream_id(k, g));
+  grid.build(params.P);
+}
+
+void build_grid(StreamingGrid &grid, const SimulationParams &params, size_t k, int g)
+{
+  grid.generate(params.P, params.seed, PhiloxEngine::stream_id(k, g));
+  grid.set_spin_realizations(params.spins);
+  grid.run();
+}
+
+// Build grid g at params.P and record its observables as step k.
+template<class G>
+void simulate(G &grid, SimulationParams params, size_t k, int g, ResultTable &table)
+{
+  auto t0 = chrono::high_resolution_clock::now();
+  build_grid(grid, params, k, g);
+  I << "  - build took "
+    << chrono::duration_cast<chrono::duration<double>>(chrono::high_resolution_clock::now()-t0).count()
+    << " s." << endl;
+
+  table.record(k, g, sample(grid, params.spins));
+  I << "P = " << params.P << ": Grid " << g+1 << "/" << params.Ngrids << " ("
+    << chrono::duration_cast<chrono::duration<double>>(chrono::high_resolution_clock::now()-t0).count()
+    << " s)" << endl;
+}
+
+// Binomial weights B(V,n,P) for all n where they are not negligible.
+struct BinomialWindow
+{
+  size_t first = 0;
+  vector<double> weights;
+  size_t last() const { return first + weights.size() - 1; }
+};
+
+BinomialWindow binomial_window(size_t V, double P)
+{
+  BinomialWindow w;
+  double mu = V*P;
+  double width = 10.0*sqrt(V*P*(1.0-P)) + 1.0;
+  w.first = (size_t)max(0.0, floor(mu - width));
+  size_t last = (size_t)min((double)V, ceil(mu + width));
+  double sum = 0.0;
+  for (size_t n = w.first; n <= last; ++n) {
+    double log_b = lgamma(V+1.0) - lgamma(n+1.0) - lgamma(V-n+1.0)
+      + n*log(P) + (V-n)*log1p(-P);
+    w.weights.push_back(exp(log_b));
+    sum += w.weights.back();
+  }
+  for (auto &b : w.weights) b /= sum;
+  return w;
+}
+
+// Newman-Ziff sweep: the grid adds the defects one by one in a random order,
+// so a single labeling pass yields the observables at all densities. Without
+// windows, the samples are taken at the same defect counts as Grid::build()
+// uses for P. With windows, the observables at all defect counts are
+// weighted with the binomial distribution of every P step. The moments
+// would need a pass over all labels at every defect count, so they are only
+// sampled without windows.
+void sweep(Grid &grid, SimulationParams params, size_t Psteps,
+           const vector<BinomialWindow> &windows, int g, ResultTable &table)
+{
+  auto t_grid_start = chrono::high_resolution_clock::now();
+  size_t V = grid.dimensions().volume();
+  bool canonical = !windows.empty();
+  vector<Sample> samples(Psteps, Sample());
+  vector<size_t> order;
+  grid.set_seed(params.seed);
+  grid.set_stream(PhiloxEngine::stream_id(0, g));
+  grid.clear();
+  grid.random_order(order);
+
+  size_t n = 0;
+  size_t k_first = 1;
+  while (true) {
+    if (canonical) {
+      while (k_first < Psteps && windows[k_first].last() < n) k_first++;
+      if (k_first < Psteps && windows[k_first].first <= n) {
+        Sample s = sample(grid, 0);
+        for (size_t k = k_first; k < Psteps && windows[k].first <= n; ++k) {
+          if (n > windows[k].last()) continue;
+          samples[k].add(windows[k].weights[n - windows[k].first], s);
+        }
+      }
+    } else {
+      while (k_first < Psteps
+             && static_cast<size_t>(V*((double)k_first/(double)Psteps)) == n)
+        samples[k_first++] = sample(grid, params.spins);
+      if (k_first == Psteps) break;
+    }
+    if (n == V) break;
+    grid.occupy(order[n++]);
+  }
+
+  for (size_t k = 1; k < Psteps; ++k) {
+    table.record(k, g, samples[k]);
+  }
+  I << "Grid " << g+1 << "/" << params.Ngrids << " ("
+    << chrono::duration_cast<chrono::duration<double>>(chrono::high_resolution_clock::now()-t_grid_start).count()
+    << " s)" << endl;
+}
+
+// Adaptive refinement of the P steps: the step halfway between two
+// neighbouring active steps becomes active if one of the averages changes
+// between them by more than tol times its range over all active steps and
+// by more than the combined standard error of the two steps, so that noise
+// alone does not refine. With the topology tracked, this includes the
+// spanning and wrapping probability. Returns the new steps.
+vector<size_t> refine_steps(vector<char> &active, const map<size_t, SimulationResults> &results,
+                            double tol)
+{
+  typedef double SimulationResults::*Field;
+  // Every average with its standard error
+  pair<Field, Field> averages[] = {
+    {&SimulationResults::avg_num_domains, &SimulationResults::sem_num_domains},
+    {&SimulationResults::avg_max_domain_size, &SimulationResults::sem_max_domain_size},
+    {&SimulationResults::avg_mean_domain_size, &SimulationResults::sem_mean_domain_size},
+    {&SimulationResults::avg_second_domain_size, &SimulationResults::sem_second_domain_size},
+    {&SimulationResults::avg_susceptibility, &SimulationResults::sem_susceptibility},
+    {&SimulationResults::avg_spanning, &SimulationResults::sem_spanning},
+    {&SimulationResults::avg_wrapping, &SimulationResults::sem_wrapping}};
+  vector<size_t> steps;
+  for (size_t k = 0; k < active.size(); ++k)
+    if (active[k]) steps.push_back(k);
+
+  vector<size_t> added;
+  for (auto field : averages) {
+    Field avg = field.first, sem = field.second;
+    double lo = HUGE_VAL, hi = -HUGE_VAL;
+    for (size_t k : steps) {
+      lo = min(lo, results.at(k).*avg);
+      hi = max(hi, results.at(k).*avg);
+    }
+    for (size_t j = 1; j < steps.size(); ++j) {
+      size_t a = steps[j-1], b = steps[j], mid = (a + b) / 2;
+      if (b - a < 2 || active[mid]) continue;
+      const SimulationResults &ra = results.at(a), &rb = results.at(b);
+      double diff = fabs(rb.*avg - ra.*avg);
+      if (diff > tol*(hi - lo) && diff > hypot(ra.*sem, rb.*sem)) {
+        active[mid] = 1;
+        added.push_back(mid);
+      }
+    }
+  }
+  sort(added.begin(), added.end());
+  return added;
+}
+
+// Partial results of a shard: the accumulators of all complete blocks
+// together with the run parameters, which identify the random streams of
+// all tasks. Merging the blocks of all shards in block order gives the same
+// results as an unsharded run.
+struct PartialResults
+{
+  struct Record
+  {
+    uint32_t k;
+    uint32_t b;
+    Accumulator::State obs[11];
+    double cluster_sizes[ClusterStats::NUM_BINS];
+  };
+
+  string key;
+  uint64_t Psteps = 0;
+  uint64_t Ngrids = 0;
+  uint64_t topology = 0;
+  vector<Record> records;
+
+  bool write(const string &path) const {
+    FILE *f = fopen(path.c_str(), "wb");
+    if (!f) return false;
+    uint64_t key_length = key.size(), num_records = records.size();
+    bool ok = fwrite("PERCPRT4", 1, 8, f) == 8
+      && fwrite(&key_length, sizeof(key_length), 1, f) == 1
+      && fwrite(key.data(), 1, key.size(), f) == key.size()
+      && fwrite(&Psteps, sizeof(Psteps), 1, f) == 1
+      && fwrite(&Ngrids, sizeof(Ngrids), 1, f) == 1
+      && fwrite(&topology, sizeof(topology), 1, f) == 1
+      && fwrite(&num_records, sizeof(num_records), 1, f) == 1
+      && fwrite(records.data(), sizeof(Record), records.size(), f) == records.size();
+    return fclose(f) == 0 && ok;
+  }
+  bool read(const string &path) {
+    FILE *f = fopen(path.c_str(), "rb");
+    if (!f) return false;
+    char magic[8];
+    uint64_t key_length = 0, num_records = 0;
+    bool ok = fread(magic, 1, 8, f) == 8 && memcmp(magic, "PERCPRT4", 8) == 0
+      && fread(&key_length, sizeof(key_length), 1, f) == 1 && key_length < 4096;
+    if (ok) {
+      key.resize(key_length);
+      ok = fread(&key[0], 1, key_length, f) == key_length
+        && fread(&Psteps, sizeof(Psteps), 1, f) == 1
+        && fread(&Ngrids, sizeof(Ngrids), 1, f) == 1
+        && fread(&topology, sizeof(topology), 1, f) == 1
+        && fread(&num_records, sizeof(num_records), 1, f) == 1;
+    }
+    if (ok) {
+      records.resize(num_records);
+      ok = fread(records.data(), sizeof(Record), num_records, f) == num_records;
+    }
+    fclose(f);
+    return ok;
+  }
 };
 
-SimulationResults simulate(SimulationParams params)
-{
-  Grid grid(params.P, {params.L, params.L, params.T}, params.grid_type);
-  SimulationResults res;
-  res.P = params.P;
-
-  vector<double> nds(params.Ngrids);
-  vector<double> mds(params.Ngrids);
-  vector<double> ads(params.Ngrids);
-  vector<double> ms(params.Ngrids);
-  vector<double> Ms(params.Ngrids);
-
-  auto t_simulation_start = chrono::high_resolution_clock::now();
-  for (int i = 0; i < params.Ngrids; ++i) {
-    auto t_grid_start = chrono::high_resolution_clock::now();
-    auto t0 = chrono::high_resolution_clock::now();
-    grid.build();
-    I << "  - build took "
-      << chrono::duration_cast<chrono::duration<double>>(chrono::high_resolution_clock::now()-t0).count()
-      << " s." << endl;
-    t0 = chrono::high_resolution_clock::now();
-    I << "  - calc_magnetization took "
-      << chrono::duration_cast<chrono::duration<double>>(chrono::high_resolution_clock::now()-t0).count()
-      << " s." << endl;
-
-    nds[i] = (double)grid.num_domains();
-    res.avg_num_domains += (double)grid.num_domains();
-    mds[i] = (double)grid.max_domain_len();
-    res.avg_max_domain_size += (double)grid.max_domain_len();
-    ads[i] = grid.avg_domain_len();
-    res.avg_mean_domain_size += grid.avg_domain_len();
-    I << "Grid " << i+1 << "/" << params.Ngrids << "("
-      << chrono::duration_cast<chrono::duration<double>>(chrono::high_resolution_clock::now()-t_grid_start).count()
-      << " s - "
-      << chrono::duration_cast<chrono::duration<double>>(chrono::high_resolution_clock::now()-t_simulation_start).count()
-      << " s total)" << endl;
-  }
-  res.avg_num_domains /= params.Ngrids;
-  res.avg_max_domain_size /= params.Ngrids;
-  res.avg_mean_domain_size /= params.Ngrids;
-  /*
-  res.avg_moment /= params.Ngrids;
-  res.avg_magnetization /= params.Ngrids;
-  */
-
-  for (int i = 0; i < params.Ngrids; ++i) {
-    res.std_num_domains += abs(nds[i]-res.avg_num_domains);
-    res.std_max_domain_size += abs(mds[i]-res.avg_max_domain_size);
-    res.std_mean_domain_size += abs(ads[i]-res.avg_mean_domain_size);
-    /*
-    res.std_moment += abs(ms[i]-res.avg_moment);
-    res.std_magnetization += abs(Ms[i]-res.avg_magnetization);
-    */
-  }
-  res.std_num_domains /= params.Ngrids;
-  res.std_max_domain_size /= params.Ngrids;
-  res.std_mean_domain_size /= params.Ngrids;
-  /*
-  res.std_moment /= params.Ngrids;
-  res.std_magnetization /= params.Ngrids;
-  */
-
-  return res;
+// With topology, the spanning and wrapping probabilities are added. With
+// num_grids, the number of grids of every P step is added as the last column.
+void print_header(bool topology = false, bool num_grids = false)
+{
+  cout << "Defect Probability,Domain Count (AVG),Domain Count (STD),Domain Count (SEM),Max Domain Size (AVG),Max Domain Size (STD),Max Domain Size (SEM),Mean Domain Size (AVG),Mean Domain Size (STD),Mean Domain Size (SEM),Second Domain Size (AVG),Second Domain Size (STD),Second Domain Size (SEM),Susceptibility (AVG),Susceptibility (STD),Susceptibility (SEM),Moment (AVG),Moment (STD),Moment (SEM),Magnetization (AVG),Magnetization (STD),Magnetization (SEM)"
+       << (topology ? ",Spanning Probability,Spanning Probability (SEM),Wrapping Probability,Wrapping Probability (SEM)" : "")
+       << (num_grids ? ",Grids" : "") << endl;
+}
+
+void print_row(const SimulationResults &res, bool topology = false, bool num_grids = false)
+{
+  cout << res.P
+       << "," << res.avg_num_domains
+       << "," << res.std_num_domains
+       << "," << res.sem_num_domains
+       << "," << res.avg_max_domain_size
+       << "," << res.std_max_domain_size
+       << "," << res.sem_max_domain_size
+       << "," << res.avg_mean_domain_size
+       << "," << res.std_mean_domain_size
+       << "," << res.sem_mean_domain_size
+       << "," << res.avg_second_domain_size
+       << "," << res.std_second_domain_size
+       << "," << res.sem_second_domain_size
+       << "," << res.avg_susceptibility
+       << "," << res.std_susceptibility
+       << "," << res.sem_susceptibility
+       << "," << res.avg_moment
+       << "," << res.std_moment
+       << "," << res.sem_moment
+       << "," << res.avg_magnetization
+       << "," << res.std_magnetization
+       << "," << res.sem_magnetization;
+  if (topology)
+    cout << "," << res.avg_spanning << "," << res.sem_spanning
+         << "," << res.avg_wrapping << "," << res.sem_wrapping;
+  if (num_grids) cout << "," << res.num_grids;
+  cout << endl;
+}
+
+// sim merge FILE...: combine the partial results of the shards of a run
+int merge(int argc, char **argv)
+{
+  if (argc < 3) {
+    cerr << "Usage: " << argv[0] << " merge FILE..." << endl;
+    return 1;
+  }
+  PartialResults first;
+  unique_ptr<ResultTable> table;
+  for (int i = 2; i < argc; ++i) {
+    PartialResults part;
+    if (!part.read(argv[i])) {
+      cerr << "Error: Cannot read partial results " << argv[i] << endl;
+      return 1;
+    }
+    if (!table) {
+      first = part;
+      table.reset(new ResultTable(part.Psteps, part.Ngrids));
+    } else if (part.key != first.key || part.Psteps != first.Psteps || part.Ngrids != first.Ngrids) {
+      cerr << "Error: " << argv[i] << " belongs to another run (" << part.key
+           << ", expected " << first.key << ")" << endl;
+      return 1;
+    }
+    for (auto &r : part.records) {
+      if (r.k >= part.Psteps || r.b >= table->num_blocks()) continue;
+      Observables obs;
+      obs.num_domains.set_state(r.obs[0]);
+      obs.max_domain_size.set_state(r.obs[1]);
+      obs.mean_domain_size.set_state(r.obs[2]);
+      obs.second_domain_size.set_state(r.obs[3]);
+      obs.susceptibility.set_state(r.obs[4]);
+      obs.spanning.set_state(r.obs[5]);
+      obs.wrapping.set_state(r.obs[6]);
+      obs.moment.set_state(r.obs[7]);
+      obs.moment_sq.set_state(r.obs[8]);
+      obs.magnetization.set_state(r.obs[9]);
+      obs.magnetization_sq.set_state(r.obs[10]);
+      copy(r.cluster_sizes, r.cluster_sizes + ClusterStats::NUM_BINS, obs.cluster_sizes);
+      table->restore_block(r.k, r.b, obs);
+    }
+  }
+
+  for (size_t k = 1; k < first.Psteps; ++k) {
+    if (!table->complete(k)) {
+      cerr << "Error: The shards do not cover all grids of P step " << k << endl;
+      return 1;
+    }
+  }
+  print_header(first.topology);
+  for (size_t k = 1; k < first.Psteps; ++k)
+    print_row(table->wait(k, (double)k/(double)first.Psteps), first.topology);
+  return 0;
 }
 
 void print_usage(const char *progname)
 {
-  cerr << "Usage: " << progname << " L T P N GRID" << endl;
+  cerr << "Usage: " << progname << " [OPTIONS] L T P N GRID" << endl;
+  cerr << "       " << progname << " merge FILE..." << endl;
   cerr << "  L: Lateral grid dimension" << endl;
   cerr << "  T: Grid thickness (in z-direction)" << endl;
   cerr << "  P: Number of defect density steps between (0,1)" << endl;
   cerr << "  N: Number of grids to simulate" << endl;
-  cerr << "  GRID: One of \"sc\", \"hex\"" << endl;
+  cerr << "  GRID: One of \"sc\", \"hex\" (hex needs an even L)" << endl;
+  cerr << "Options:" << endl;
+  cerr << "  --sweep: Sample all P steps in a single Newman-Ziff sweep per grid" << endl;
+  cerr << "  --canonical: With --sweep, average over the binomial distribution" << endl;
+  cerr << "               of the defect count at each P" << endl;
+  cerr << "  --threads N: Number of worker threads (default: all hardware threads)" << endl;
+  cerr << "  --compact: Release the labeling buffers after every grid (4-5 bytes" << endl;
+  cerr << "             per cell, about 6 while labeling)" << endl;
+  cerr << "  --stream: Label the grids layer by layer with memory proportional to" << endl;
+  cerr << "            L*T. Every cell is a defect with probability P, so the defect" << endl;
+  cerr << "            count varies between the grids" << endl;
+  cerr << "  --checkpoint FILE: Log every finished task to FILE and skip the tasks" << endl;
+  cerr << "                     that are already in it" << endl;
+  cerr << "  --output FILE: Also write the samples of every grid and the averages" << endl;
+  cerr << "                 to the columnar file FILE (see tocsv)" << endl;
+  cerr << "  --shard I/N: Only run the I-th of N shards of the tasks (0 <= I < N)" << endl;
+  cerr << "               and write the partial results to the --partial file" << endl;
+  cerr << "  --partial FILE: Write partial results instead of the CSV rows. The" << endl;
+  cerr << "                  partial results of all shards are combined with" << endl;
+  cerr << "                  \"merge\"" << endl;
+  cerr << "  --target-error E: Stop sampling a P step as soon as the relative" << endl;
+  cerr << "                    standard error of every average is at most E," << endl;
+  cerr << "                    checked every " << ADAPTIVE_BLOCK_GRIDS << " grids." << endl;
+  cerr << "                    N is then the maximum number of grids per P step" << endl;
+  cerr << "                    and the grids are added as the last column. Not" << endl;
+  cerr << "                    with --sweep or --shard" << endl;
+  cerr << "  --refine D: Halve the P steps up to D times where one of the averages" << endl;
+  cerr << "              changes between neighbouring steps by more than the" << endl;
+  cerr << "              --refine-tol fraction of its range and by more than" << endl;
+  cerr << "              its standard error. Not with --sweep or --shard" << endl;
+  cerr << "  --refine-tol F: Refinement tolerance (default: 0.05)" << endl;
+  cerr << "  --spanning: Add the probabilities that a domain spans the grid in x" << endl;
+  cerr << "              or y (with open boundaries) and that a domain wraps" << endl;
+  cerr << "              around the periodic grid in x or y. Not with --sweep" << endl;
+  cerr << "              or --stream" << endl;
+  cerr << "  --spins R: Number of random spin assignments to the domains of every" << endl;
+  cerr << "             grid for the moment and magnetization (default: 64, 0" << endl;
+  cerr << "             to skip them). Not sampled with --canonical" << endl;
+  cerr << "  --memory: Report the peak memory footprint of the grids" << endl;
+  cerr << "  --seed S: Seed of the random streams (default: 0). The results only" << endl;
+  cerr << "            depend on the seed, not on the number of threads" << endl;
 }
 
 int main(int argc, char **argv)
 {
+  if (argc > 1 && string(argv[1]) == "merge") return merge(argc, argv);
+
   SimulationParams params;
   params.Ngrids = 10;
   params.Niter = 100;
   params.grid_type = Grid::GRID_SC;
+  params.seed = 0;
+  params.spins = 64;
   size_t Psteps;
+  bool sweep_mode = false;
+  bool canonical = false;
+  size_t Nthreads = 0;
+  bool compact = false;
+  bool streaming = false;
+  bool report_memory = false;
+  bool topology = false;
+  string checkpoint;
+  string output_path;
+  string partial_path;
+  size_t shard_index = 0, shard_count = 1;
+  double target_error = 0.0;
+  int refine_levels = 0;
+  double refine_tol = 0.05;
+
+  vector<char*> args;
+  for (int i = 0; i < argc; ++i) {
+    string s(argv[i]);
+    if (s == "--sweep") sweep_mode = true;
+    else if (s == "--canonical") canonical = true;
+    else if (s == "--compact") compact = true;
+    else if (s == "--stream") streaming = true;
+    else if (s == "--memory") report_memory = true;
+    else if (s == "--spanning") topology = true;
+    else if (s == "--checkpoint" && i+1 < argc) checkpoint = argv[++i];
+    else if (s == "--output" && i+1 < argc) output_path = argv[++i];
+    else if (s == "--partial" && i+1 < argc) partial_path = argv[++i];
+    else if (s == "--target-error" && i+1 < argc) target_error = atof(argv[++i]);
+    else if (s == "--refine" && i+1 < argc) refine_levels = atoi(argv[++i]);
+    else if (s == "--refine-tol" && i+1 < argc) refine_tol = atof(argv[++i]);
+    else if (s == "--shard" && i+1 < argc) {
+      if (sscanf(argv[++i], "%zu/%zu", &shard_index, &shard_count) != 2
+          || shard_count == 0 || shard_index >= shard_count) {
+        cerr << "Error: Invalid shard " << argv[i] << endl;
+        return 1;
+      }
+    }
+    else if (s == "--threads" && i+1 < argc) Nthreads = atoi(argv[++i]);
+    else if (s == "--spins" && i+1 < argc) params.spins = strtoull(argv[++i], nullptr, 10);
+    else if (s == "--seed" && i+1 < argc) params.seed = strtoull(argv[++i], nullptr, 10);
+    else if (s.compare(0, 2, "--") == 0) {
+      cerr << "Error: Unknown option " << s << endl;
+      print_usage(argv[0]);
+      return 1;
+    }
+    else args.push_back(argv[i]);
+  }
+  argc = args.size();
 
-  if (argc <= 3) {
+  if (argc <= 3 || (canonical && !sweep_mode) || (streaming && sweep_mode)
+      || (topology && (sweep_mode || streaming))
+      || (shard_count > 1 && partial_path.empty())
+      || ((target_error > 0.0 || refine_levels > 0) && (sweep_mode || !partial_path.empty()))
+      || refine_levels < 0 || refine_levels > 16) {
     print_usage(argv[0]);
     return 1;
   }
 
-  params.L = atoi(argv[1]);
-  params.T = atoi(argv[2]);
-  Psteps = atoi(argv[3]);
+  params.L = atoi(args[1]);
+  params.T = atoi(args[2]);
+  // With --refine, the coarse steps are every stride-th of the finest steps
+  size_t stride = size_t(1) << refine_levels;
+  Psteps = atoi(args[3]) * stride;
 
   if (argc > 4)
-    params.Ngrids = atoi(argv[4]);
+    params.Ngrids = atoi(args[4]);
   if (argc > 5) {
-    string s(argv[5]);
+    string s(args[5]);
     if (s == "hex") params.grid_type = Grid::GRID_HEX;
     else if (s != "sc") {
       print_usage(argv[0]);
       return 1;
     }
   }
+  if (!Grid::valid_dimensions({params.L, params.L, params.T}, params.grid_type)) {
+    cerr << "Error: A hex grid needs an even L" << endl;
+    return 1;
+  }
+
+  // One task per (P, grid) pair, or per grid in sweep mode. Every worker
+  // reuses its own grid.
+  ResultTable table(Psteps, params.Ngrids,
+                    target_error > 0.0 ? ADAPTIVE_BLOCK_GRIDS : BLOCK_GRIDS);
+  table.set_target(target_error);
+  vector<BinomialWindow> windows;
+
+  unique_ptr<columnar::Writer> output;
+  size_t aggregates = 0, cluster_sizes = 0;
+  if (!output_path.empty()) {
+    output.reset(new columnar::Writer(output_path));
+    if (!output->is_open()) {
+      cerr << "Error: Cannot open output " << output_path << endl;
+      return 1;
+    }
+    vector<columnar::Column> samples = {
+      {"step", columnar::UINT64}, {"P", columnar::DOUBLE}, {"grid", columnar::UINT64},
+      {"num_domains", columnar::DOUBLE}, {"max_domain", columnar::DOUBLE},
+      {"mean_domain", columnar::DOUBLE}, {"second_domain", columnar::DOUBLE},
+      {"susceptibility", columnar::DOUBLE}, {"moment", columnar::DOUBLE},
+      {"magnetization", columnar::DOUBLE}};
+    vector<columnar::Column> averages = {
+      {"P", columnar::DOUBLE},
+      {"num_domains_avg", columnar::DOUBLE}, {"num_domains_std", columnar::DOUBLE},
+      {"num_domains_sem", columnar::DOUBLE},
+      {"max_domain_avg", columnar::DOUBLE}, {"max_domain_std", columnar::DOUBLE},
+      {"max_domain_sem", columnar::DOUBLE},
+      {"mean_domain_avg", columnar::DOUBLE}, {"mean_domain_std", columnar::DOUBLE},
+      {"mean_domain_sem", columnar::DOUBLE},
+      {"second_domain_avg", columnar::DOUBLE}, {"second_domain_std", columnar::DOUBLE},
+      {"second_domain_sem", columnar::DOUBLE},
+      {"susceptibility_avg", columnar::DOUBLE}, {"susceptibility_std", columnar::DOUBLE},
+      {"susceptibility_sem", columnar::DOUBLE},
+      {"moment_avg", columnar::DOUBLE}, {"moment_std", columnar::DOUBLE},
+      {"moment_sem", columnar::DOUBLE},
+      {"magnetization_avg", columnar::DOUBLE}, {"magnetization_std", columnar::DOUBLE},
+      {"magnetization_sem", columnar::DOUBLE}};
+    if (topology) {
+      samples.insert(samples.end(), {{"spanning", columnar::DOUBLE},
+                                     {"wrapping", columnar::DOUBLE}});
+      averages.insert(averages.end(), {{"spanning_avg", columnar::DOUBLE},
+                                       {"spanning_sem", columnar::DOUBLE},
+                                       {"wrapping_avg", columnar::DOUBLE},
+                                       {"wrapping_sem", columnar::DOUBLE}});
+    }
+    table.set_output(output.get(), output->add_table("samples", samples), topology);
+    aggregates = output->add_table("aggregates", averages);
+    // Domain size distribution n_s of every P step: the domains per size
+    // bin [size_min, size_max] over all grids, and per cell and size
+    cluster_sizes = output->add_table("cluster_sizes", {
+      {"P", columnar::DOUBLE}, {"size_min", columnar::UINT64}, {"size_max", columnar::UINT64},
+      {"count", columnar::DOUBLE}, {"n_s", columnar::DOUBLE}});
+  }
+
+  // The run parameters that determine the random streams of all tasks
+  string key = to_string(params.L) + " " + to_string(params.T) + " " + to_string(Psteps)
+    + " " + to_string(params.Ngrids) + " " + (params.grid_type == Grid::GRID_HEX ? "hex" : "sc")
+    + " seed=" + to_string(params.seed) + (sweep_mode ? " sweep" : "")
+    + (canonical ? " canonical" : "") + (streaming ? " stream" : "")
+    + (topology ? " spanning" : "") + " spins=" + to_string(params.spins);
 
-  // Output csv header
-  cout << "Defect Probability,Domain Count (AVG),Domain Count (STD),Max Domain Size (AVG),Max Domain Size (STD),Mean Domain Size (AVG),Mean Domain Size (STD)" << endl;
+  // A shard runs every shard_count-th unit of work. A unit is a block of
+  // grids at one P step, or a block of grids at all P steps in sweep mode.
+  auto in_shard = [&](size_t k, int g) {
+    size_t unit = (sweep_mode ? 0 : (k-1)*table.num_blocks()) + g / table.grids_per_block();
+    return unit % shard_count == shard_index;
+  };
 
+  // done[k][g]: the task (k, g) is restored from the checkpoint, with an
+  // entry only for the P steps in the log. In sweep mode a grid is only
+  // done if all its P steps are in the log.
+  TaskLog log;
+  map<size_t, vector<char>> done;
+  auto is_done = [&](size_t k, int g) {
+    auto it = done.find(k);
+    return it != done.end() && it->second[g];
+  };
+  if (!checkpoint.empty()) {
+    vector<TaskLog::Record> records;
+    string shard = " shard=" + to_string(shard_index) + "/" + to_string(shard_count);
+    if (!log.open(checkpoint, key + shard, records)) {
+      cerr << "Error: Cannot open checkpoint " << checkpoint << " for this run" << endl;
+      return 1;
+    }
+    vector<TaskLog::Record> restored;
+    for (auto &r : records) {
+      if (r.k < 1 || r.k >= Psteps || (int)r.g >= params.Ngrids || is_done(r.k, r.g)) continue;
+      vector<char> &d = done[r.k];
+      d.resize(params.Ngrids);
+      d[r.g] = 1;
+      restored.push_back(r);
+    }
+    if (sweep_mode) {
+      for (int g = 0; g < params.Ngrids; ++g) {
+        bool complete = true;
+        for (size_t k = 1; k < Psteps; ++k) complete = complete && is_done(k, g);
+        for (auto &d : done) d.second[g] = complete;
+      }
+    }
+    for (auto &r : restored)
+      if (is_done(r.k, r.g)) table.restore(r);
+    table.set_log(&log);
+    I << "Restored " << restored.size() << " tasks from " << checkpoint << endl;
+  }
+  Scheduler scheduler(Nthreads);
+  vector<unique_ptr<Grid>> grids(streaming ? 0 : scheduler.size());
+  vector<unique_ptr<StreamingGrid>> stream_grids(streaming ? scheduler.size() : 0);
+  for (auto &grid : grids) {
+    grid.reset(new Grid(0.0, {params.L, params.L, params.T}, params.grid_type));
+    grid->set_compact(compact);
+    grid->set_topology(topology);
+  }
+  for (auto &grid : stream_grids)
+    grid.reset(new StreamingGrid({params.L, params.L, params.T}, params.grid_type));
+  auto worker_grid = [&]() -> Grid& { return *grids[Scheduler::worker_index()]; };
+  auto worker_stream_grid = [&]() -> StreamingGrid& {
+    return *stream_grids[Scheduler::worker_index()];
+  };
 
-  future<SimulationResults> results[Nthreads];
-  size_t step = 1;
-  for (size_t t = 0; t < Nthreads && step+t < Psteps; t++) {
-    params.P = (double)(step+t)/(double)Psteps;
-    results[t] = async(launch::async, simulate, params);
+  // With a target error, the grids of a P step are submitted block by block.
+  // Every finished grid hands out the next blocks of its P step, and grids of
+  // finished P steps are skipped.
+  function<void(size_t)> schedule;
+  // active[k]: the P step k is sampled. Without --refine all steps are.
+  vector<char> active(Psteps, 1);
+  map<size_t, SimulationResults> results;
+  auto submit = [&](size_t k, int g) {
+    SimulationParams p = params;
+    p.P = (double)k/(double)Psteps;
+    scheduler.submit([&, p, k, g] {
+      if (target_error > 0.0 && table.complete(k)) return;
+      if (streaming) simulate(worker_stream_grid(), p, k, g, table);
+      else simulate(worker_grid(), p, k, g, table);
+      if (target_error > 0.0) schedule(k);
+    });
+  };
+  schedule = [&](size_t k) {
+    int b;
+    while ((b = table.next_block(k, ADAPTIVE_LOOKAHEAD)) >= 0)
+      for (int g = b*table.grids_per_block();
+           g < min(params.Ngrids, (b+1)*table.grids_per_block()); ++g)
+        if (!is_done(k, g)) submit(k, g);
+  };
+  if (sweep_mode) {
+    if (canonical) {
+      windows.resize(Psteps);
+      for (size_t k = 1; k < Psteps; ++k)
+        windows[k] = binomial_window(params.L*params.L*params.T, (double)k/(double)Psteps);
+    }
+    for (int g = 0; g < params.Ngrids; ++g)
+      if (in_shard(1, g) && (Psteps < 2 || !is_done(1, g)))
+        scheduler.submit([&, g] { sweep(worker_grid(), params, Psteps, windows, g, table); });
+  } else {
+    auto start_step = [&](size_t k) {
+      if (target_error > 0.0) {
+        schedule(k);
+        return;
+      }
+      for (int g = 0; g < params.Ngrids; ++g)
+        if (!is_done(k, g) && in_shard(k, g)) submit(k, g);
+    };
+    fill(active.begin(), active.end(), 0);
+    for (size_t k = stride; k < Psteps; k += stride) {
+      active[k] = 1;
+      start_step(k);
+    }
+    // Refine level by level once all active steps are finished
+    vector<size_t> added;
+    for (int level = 0; level < refine_levels; ++level) {
+      for (size_t k = 1; k < Psteps; ++k)
+        if (active[k]) results[k] = table.wait(k, (double)k/(double)Psteps);
+      added = refine_steps(active, results, refine_tol);
+      I << "Refinement " << level+1 << ": " << added.size() << " new P steps" << endl;
+      if (added.empty()) break;
+      for (size_t k : added) start_step(k);
+    }
   }
-  while(step < Psteps) {
-    for (size_t t = 0; t < Nthreads && step+t < Psteps; t++) {
-      auto res = results[t].get();
-      if (step+Nthreads+t < Psteps) {
-        params.P = (double)(step+Nthreads+t)/(double)Psteps;
-        results[t] = async(launch::async, simulate, params);
+
+  if (!partial_path.empty()) {
+    scheduler.wait();
+    PartialResults part;
+    part.key = key;
+    part.Psteps = Psteps;
+    part.Ngrids = params.Ngrids;
+    part.topology = topology;
+    table.for_each_block([&](size_t k, size_t b, const Observables &obs) {
+      PartialResults::Record r = {(uint32_t)k, (uint32_t)b, {obs.num_domains.state(),
+          obs.max_domain_size.state(), obs.mean_domain_size.state(),
+          obs.second_domain_size.state(), obs.susceptibility.state(),
+          obs.spanning.state(), obs.wrapping.state(), obs.moment.state(),
+          obs.moment_sq.state(), obs.magnetization.state(), obs.magnetization_sq.state()}, {0}};
+      copy(obs.cluster_sizes, obs.cluster_sizes + ClusterStats::NUM_BINS, r.cluster_sizes);
+      part.records.push_back(r);
+    });
+    if (!part.write(partial_path)) {
+      cerr << "Error: Cannot write partial results " << partial_path << endl;
+      return 1;
+    }
+  } else {
+    print_header(topology, target_error > 0.0);
+    for (size_t k = 1; k < Psteps; ++k) {
+      if (!active[k]) continue;
+      SimulationResults res = table.wait(k, (double)k/(double)Psteps);
+      print_row(res, topology, target_error > 0.0);
+      if (!output) continue;
+      vector<columnar::Value> row = {res.P, res.avg_num_domains, res.std_num_domains,
+                                     res.sem_num_domains, res.avg_max_domain_size,
+                                     res.std_max_domain_size, res.sem_max_domain_size,
+                                     res.avg_mean_domain_size, res.std_mean_domain_size,
+                                     res.sem_mean_domain_size, res.avg_second_domain_size,
+                                     res.std_second_domain_size, res.sem_second_domain_size,
+                                     res.avg_susceptibility, res.std_susceptibility,
+                                     res.sem_susceptibility, res.avg_moment, res.std_moment,
+                                     res.sem_moment, res.avg_magnetization,
+                                     res.std_magnetization, res.sem_magnetization};
+      if (topology)
+        row.insert(row.end(), {res.avg_spanning, res.sem_spanning, res.avg_wrapping,
+                               res.sem_wrapping});
+      output->append(aggregates, row);
+      double cells = (double)res.num_grids * (double)(params.L*params.L*params.T);
+      for (int b = 0; b < ClusterStats::NUM_BINS; ++b) {
+        if (res.cluster_sizes[b] == 0.0) continue;
+        uint64_t lo = uint64_t(1) << b, hi = 2*lo - 1;
+        output->append(cluster_sizes, {res.P, lo, hi, res.cluster_sizes[b],
+                                       res.cluster_sizes[b] / (cells * (double)lo)});
       }
-      cout << res.P
-           << "," << res.avg_num_domains
-           << "," << res.std_num_domains
-           << "," << res.avg_max_domain_size
-           << "," << res.std_max_domain_size
-           << "," << res.avg_mean_domain_size
-           << "," << res.std_mean_domain_size
-           << endl;
-    }
-    step += Nthreads;
+    }
+  }
+
+  scheduler.wait();
+  if (report_memory) {
+    size_t peak = 0;
+    for (auto &grid : grids) peak = max(peak, grid->peak_memory_usage());
+    for (auto &grid : stream_grids) peak = max(peak, grid->memory_usage());
+    cerr << "Peak memory per grid: " << peak << " bytes ("
+         << (double)peak / (double)(params.L*params.L*params.T) << " bytes per cell)" << endl;
   }
 
   return 0;
@@ -0,0 +1,166 @@
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <unistd.h>
+#include "snapshot.h"
+
+using namespace std;
+
+static const char MAGIC[8] = {'P', 'E', 'R', 'C', 'S', 'N', 'A', 'P'};
+
+static size_t padded(size_t bytes)
+{
+  return (bytes + 7) & ~size_t(7);
+}
+
+// Byte offsets of the sections and the total file size
+static size_t layout(const Snapshot::Header &h, size_t offsets[4])
+{
+  size_t bytes[4] = {
+    h.num_words*sizeof(BitLattice::Word),
+    h.X*h.Y*h.Z*sizeof(label_t),
+    h.num_labels*sizeof(label_t),
+    h.num_labels*sizeof(label_t)
+  };
+  size_t pos = sizeof(Snapshot::Header);
+  for (int k = 0; k < 4; ++k) {
+    offsets[k] = pos;
+    pos += padded(bytes[k]);
+  }
+  return pos;
+}
+
+// writev() until all buffers are written
+static bool write_all(int fd, iovec *iov, int n)
+{
+  while (n > 0) {
+    ssize_t w = writev(fd, iov, n);
+    if (w < 0) {
+      if (errno == EINTR) continue;
+      return false;
+    }
+    while (n > 0 && (size_t)w >= iov->iov_len) {
+      w -= iov->iov_len;
+      ++iov;
+      --n;
+    }
+    if (n > 0) {
+      iov->iov_base = static_cast<char*>(iov->iov_base) + w;
+      iov->iov_len -= w;
+    }
+  }
+  return true;
+}
+
+bool Snapshot::write(const Grid &grid, const string &path)
+{
+  Header h;
+  memset(&h, 0, sizeof(h));
+  memcpy(h.magic, MAGIC, sizeof(MAGIC));
+  h.version = VERSION;
+  h.grid_type = grid.grid_type;
+  h.label_bits = 8*sizeof(label_t);
+  h.X = grid.dim.X;
+  h.Y = grid.dim.Y;
+  h.Z = grid.dim.Z;
+  h.P = grid.P;
+  h.seed = grid.seed;
+  h.stream = grid.stream;
+  h.rng_position = grid.generator.position();
+  h.occupied = grid.occupied;
+  h.domain_count = grid.domain_count;
+  h.largest_domain = grid.largest_domain;
+  h.next_new_label = grid.next_new_label;
+  h.num_words = grid.cells.num_words();
+  h.num_labels = grid.forest.count();
+
+  static const char zeros[8] = {0};
+  const void *sections[4] = {grid.cells.words(), grid.labels.data(),
+                             grid.forest.parent_data(), grid.forest.size_data()};
+  size_t offsets[4];
+  size_t total = layout(h, offsets);
+  iovec iov[9];
+  int n = 0;
+  iov[n++] = {&h, sizeof(h)};
+  for (int k = 0; k < 4; ++k) {
+    size_t end = k < 3 ? offsets[k+1] : total;
+    size_t bytes = k == 0 ? h.num_words*sizeof(BitLattice::Word)
+      : k == 1 ? grid.labels.size()*sizeof(label_t) : h.num_labels*sizeof(label_t);
+    iov[n++] = {const_cast<void*>(sections[k]), bytes};
+    if (end - offsets[k] > bytes) iov[n++] = {const_cast<char*>(zeros), end - offsets[k] - bytes};
+  }
+
+  string tmp = path + ".tmp";
+  int fd = ::open(tmp.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  if (fd < 0) return false;
+  bool ok = write_all(fd, iov, n);
+  ok = ::close(fd) == 0 && ok;
+  if (ok) ok = rename(tmp.c_str(), path.c_str()) == 0;
+  if (!ok) unlink(tmp.c_str());
+  return ok;
+}
+
+bool Snapshot::open(const string &path)
+{
+  close();
+  int fd = ::open(path.c_str(), O_RDONLY);
+  if (fd < 0) return false;
+  struct stat st;
+  if (fstat(fd, &st) != 0 || (size_t)st.st_size < sizeof(Header)) {
+    ::close(fd);
+    return false;
+  }
+  void *p = mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  ::close(fd);
+  if (p == MAP_FAILED) return false;
+  data = static_cast<const unsigned char*>(p);
+  length = st.st_size;
+
+  const Header &h = header();
+  if (memcmp(h.magic, MAGIC, sizeof(MAGIC)) != 0 || h.version != VERSION
+      || h.label_bits != 8*sizeof(label_t)
+      || h.num_words != (h.X*h.Y*h.Z + BitLattice::WORD_BITS - 1)/BitLattice::WORD_BITS
+      || layout(h, offsets) != length) {
+    close();
+    return false;
+  }
+  return true;
+}
+
+void Snapshot::close()
+{
+  if (data) munmap(const_cast<unsigned char*>(data), length);
+  data = nullptr;
+  length = 0;
+}
+
+bool Snapshot::restore(Grid &grid) const
+{
+  if (!is_open()) return false;
+  const Header &h = header();
+  Grid::Dimensions dim = dimensions();
+  if (dim.X != grid.dim.X || dim.Y != grid.dim.Y || dim.Z != grid.dim.Z
+      || type() != grid.grid_type)
+    return false;
+
+  memcpy(grid.cells.words(), words(), h.num_words*sizeof(BitLattice::Word));
+  memcpy(grid.labels.data(), labels(), grid.labels.size()*sizeof(label_t));
+  grid.forest.assign(parents(), sizes(), h.num_labels);
+  grid.P = h.P;
+  grid.seed = h.seed;
+  grid.stream = h.stream;
+  grid.generator.seed(h.seed, h.stream);
+  grid.generator.discard(h.rng_position);
+  grid.occupied = h.occupied;
+  grid.domain_count = h.domain_count;
+  grid.largest_domain = h.largest_domain;
+  grid.next_new_label = h.next_new_label;
+  grid.rebuild_stats();
+  grid.domain_table_valid = false;
+  grid.label_spins_valid = false;
+  return true;
+}
@@ -0,0 +1,88 @@
+#ifndef SNAPSHOT_H
+#define SNAPSHOT_H
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+
+#include "grid.h"
+
+
+// Versioned binary snapshot of a Grid: dimensions, lattice type, P, the
+// state of the random stream, the occupancy bits, the cell labels and the
+// forest. The file is a Header followed by the sections
+//
+//   occupancy  num_words 64-bit words, packed like a BitLattice
+//   labels     X*Y*Z label_t
+//   parents    num_labels label_t
+//   sizes      num_labels label_t
+//
+// in native byte order, each padded to a multiple of 8 bytes. A snapshot is
+// written with a single writev() to a temporary file that is then renamed,
+// so a crash never leaves a truncated snapshot behind. Reading maps the file
+// read-only. The section accessors point into the mapping, but restore()
+// copies the sections into the grid, since a grid owns its buffers and
+// keeps changing them. Loading thus costs one pass over the grid memory.
+class Snapshot
+{
+public:
+  static const uint32_t VERSION = 1;
+
+  struct Header
+  {
+    char magic[8];
+    uint32_t version;
+    uint32_t grid_type;
+    uint32_t label_bits;
+    uint32_t reserved;
+    uint64_t X, Y, Z;
+    double P;
+    uint64_t seed;
+    uint64_t stream;
+    uint64_t rng_position;
+    uint64_t occupied;
+    uint64_t domain_count;
+    uint64_t largest_domain;
+    uint64_t next_new_label;
+    uint64_t num_words;
+    uint64_t num_labels;
+  };
+
+  // Write the state of grid to path. Returns false on error.
+  static bool write(const Grid &grid, const std::string &path);
+
+  Snapshot() {}
+  ~Snapshot() { close(); }
+  Snapshot(const Snapshot&) = delete;
+  Snapshot& operator=(const Snapshot&) = delete;
+
+  // Map the snapshot at path. Returns false if the file cannot be mapped or
+  // is not a snapshot of this version and label width.
+  bool open(const std::string &path);
+  void close();
+  bool is_open() const { return data != nullptr; }
+
+  const Header& header() const { return *reinterpret_cast<const Header*>(data); }
+  Grid::Dimensions dimensions() const { return {header().X, header().Y, header().Z}; }
+  Grid::GridType type() const { return (Grid::GridType)header().grid_type; }
+  double density() const { return header().P; }
+  const BitLattice::Word* words() const { return section<BitLattice::Word>(0); }
+  const label_t* labels() const { return section<label_t>(1); }
+  const label_t* parents() const { return section<label_t>(2); }
+  const label_t* sizes() const { return section<label_t>(3); }
+
+  // Copy the snapshot into grid, which must have the same dimensions and
+  // type. The grid continues with the same random stream and does not
+  // refer to the mapping afterwards.
+  bool restore(Grid &grid) const;
+
+private:
+  template<typename T>
+  const T* section(int k) const { return reinterpret_cast<const T*>(data + offsets[k]); }
+
+  const unsigned char *data = nullptr;
+  size_t length = 0;
+  size_t offsets[4] = {0, 0, 0, 0};
+};
+
+#endif
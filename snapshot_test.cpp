@@ -0,0 +1,84 @@
+#include <cstdio>
+#include <iostream>
+#include <string>
+#include <vector>
+
+#include "snapshot.h"
+
+using namespace std;
+
+static int failures = 0;
+
+static void check(bool ok, const string &what)
+{
+  if (ok) return;
+  if (failures < 20) cerr << what << endl;
+  failures++;
+}
+
+// Domains with their labels, statistics and projections of the grids agree
+static void compare(const Grid &a, const Grid &b, const string &where)
+{
+  check(a.density() == b.density(), where + ": density");
+  check(a.num_domains() == b.num_domains() && a.max_domain_len() == b.max_domain_len()
+        && a.second_domain_len() == b.second_domain_len(), where + ": statistics");
+  check(a.cluster_stats().cells() == b.cluster_stats().cells()
+        && a.cluster_stats().susceptibility() == b.cluster_stats().susceptibility(),
+        where + ": cluster statistics");
+  const DomainTable &da = a.domains(), &db = b.domains();
+  bool same = da.size() == db.size();
+  for (size_t d = 0; same && d < da.size(); ++d)
+    same = da.label(d) == db.label(d) && vector<size_t>(da[d].begin(), da[d].end())
+      == vector<size_t>(db[d].begin(), db[d].end());
+  check(same, where + ": domains");
+  check(a.project_domains() == b.project_domains(), where + ": domain projection");
+  check(a.project_spins() == b.project_spins(), where + ": spin projection");
+}
+
+// A restored grid is the saved grid: same labels, statistics and spins,
+// and it continues with the same random stream, so update() adds the same
+// defects to both.
+int main()
+{
+  const string path = "snapshot_test.snap";
+
+  Snapshot closed;
+  Grid g(0.3, {8, 8, 2});
+  check(!closed.restore(g), "restore from a snapshot that is not open");
+
+  for (int t = 0; t < 2; ++t) {
+    Grid::GridType type = t ? Grid::GRID_HEX : Grid::GRID_SC;
+    string where = t ? "hex" : "sc";
+    Grid a(0.3, {40, 30, 7}, type, 5);
+    a.set_stream(9);
+    a.build();
+    a.update(0.4);
+    check(Snapshot::write(a, path), where + ": write");
+
+    Snapshot s;
+    check(s.open(path), where + ": open");
+    if (!s.is_open()) continue;
+    check(s.dimensions().volume() == a.dimensions().volume() && s.type() == type,
+          where + ": header");
+    Grid b(0.0, s.dimensions(), s.type());
+    check(s.restore(b), where + ": restore");
+    compare(a, b, where + " restored");
+
+    Grid other(0.0, {40, 30, 6}, type);
+    check(!s.restore(other), where + ": restore into other dimensions");
+
+    a.update(0.6);
+    b.update(0.6);
+    compare(a, b, where + " updated after restore");
+  }
+
+  FILE *f = fopen(path.c_str(), "w");
+  fputs("not a snapshot", f);
+  fclose(f);
+  Snapshot bad;
+  check(!bad.open(path), "open a file that is not a snapshot");
+  remove(path.c_str());
+
+  if (failures > 0) cerr << failures << " failures" << endl;
+  return failures > 0;
+}
@@ -0,0 +1,237 @@
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+#include <stdexcept>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include "streaming.h"
+
+using namespace std;
+
+
+StreamingGrid::StreamingGrid(Grid::Dimensions dim, Grid::GridType grid_type)
+  : dim(dim), grid_type(grid_type), layer(dim.Y*dim.Z)
+{
+  if (!Grid::valid_dimensions(dim, grid_type))
+    throw invalid_argument("StreamingGrid: a hexagonal lattice needs an even Y, not "
+                           + to_string(dim.Y));
+}
+
+StreamingGrid::~StreamingGrid()
+{
+  unmap();
+}
+
+void StreamingGrid::unmap()
+{
+  if (mapped) munmap(const_cast<unsigned char*>(mapped), mapped_bytes);
+  mapped = nullptr;
+  mapped_bytes = 0;
+}
+
+void StreamingGrid::generate(double P, uint64_t seed, uint64_t stream)
+{
+  unmap();
+  this->P = P;
+  this->seed = seed;
+  this->stream = stream;
+}
+
+bool StreamingGrid::map_file(const string &path, size_t offset)
+{
+  unmap();
+  int fd = open(path.c_str(), O_RDONLY);
+  if (fd < 0) return false;
+  struct stat st;
+  size_t needed = offset + (dim.volume() + 7)/8;
+  if (fstat(fd, &st) != 0 || (size_t)st.st_size < needed) {
+    close(fd);
+    return false;
+  }
+  void *p = mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (p == MAP_FAILED) return false;
+  madvise(p, st.st_size, MADV_SEQUENTIAL);
+  mapped = static_cast<const unsigned char*>(p);
+  mapped_bytes = st.st_size;
+  mapped_offset = offset;
+  return true;
+}
+
+// Fill layer with the occupancy of the cells [x*Y*Z, (x+1)*Y*Z).
+void StreamingGrid::load_layer(size_t x)
+{
+  size_t n = dim.Y*dim.Z, first = x*n;
+  BitLattice::Word *w = layer.words();
+  const size_t B = BitLattice::WORD_BITS;
+
+  if (!mapped) {
+    layer.clear();
+    if (P >= 1.0) {
+      for (size_t j = 0; j < n; ++j) layer.set(j);
+      return;
+    }
+    uint64_t threshold = (uint64_t)ldexp(P, 64);
+    for (size_t j = 0; j < n; ++j)
+      if (PhiloxEngine::at(seed, stream, first + j) < threshold) w[j / B] |= BitLattice::Word(1) << (j % B);
+    return;
+  }
+
+  // The layer does not start at a word boundary in general, so the words
+  // are shifted together from the mapped bytes.
+  const unsigned char *base = mapped + mapped_offset;
+  size_t total_bytes = (dim.volume() + 7)/8;
+  auto load_word = [&](size_t bit) {
+    size_t byte = bit / 8;
+    BitLattice::Word v = 0;
+    memcpy(&v, base + byte, min(sizeof(v), total_bytes - byte));
+    return v >> (bit % 8);
+  };
+  for (size_t k = 0; k < layer.num_words(); ++k) {
+    size_t bit = first + k*B;
+    BitLattice::Word v = load_word(bit);
+    // load_word() has at most 57 valid bits after the shift
+    if (bit % 8 != 0 && bit + 64 - bit % 8 < dim.volume())
+      v |= load_word(bit + 64 - bit % 8) << (64 - bit % 8);
+    w[k] = v;
+  }
+  if (n % B) w[layer.num_words() - 1] &= ~BitLattice::Word(0) >> (B - n % B);
+}
+
+// Label the occupied cells of layer x in cur. Bonds within the layer and to
+// the previous layer are merged right away; the bonds from the first to the
+// last layer are merged at the end of run().
+template<class Lattice>
+void StreamingGrid::label_layer(size_t x)
+{
+  size_t n = dim.Y*dim.Z;
+  fill(cur.begin(), cur.end(), 0);
+  for (size_t j = layer.find_next(0); j < n; j = layer.find_next(j)) {
+    size_t run_end = layer.find_next_clear(j);
+    size_t y = j / dim.Z, z = j % dim.Z;
+    for (; j < run_end; ++j) {
+      const Offset *s = Lattice::stencil(y);
+      size_t label = 0;
+      for (int k = 0; k < Lattice::NUM_NEIGHBORS; ++k) {
+        const vector<label_t> *neighbors;
+        if (s[k].dx == 0) neighbors = &cur;
+        else if (s[k].dx < 0 && x > 0) neighbors = &prev;
+        else continue;
+        size_t l = (*neighbors)[wrap(y, s[k].dy, dim.Y)*dim.Z + wrap(z, s[k].dz, dim.Z)];
+        if (l == 0) continue;
+        size_t r = forest.find(l);
+        if (label == 0) {
+          label = r;
+        } else if (r != label) {
+          label = forest.unite(label, r);
+          domain_count--;
+        }
+      }
+      if (label == 0) {
+        label = forest.make_set();
+        domain_count++;
+      } else {
+        forest.size(label)++;
+      }
+      largest_domain = max<size_t>(largest_domain, forest.size(label));
+      cur[j] = label;
+      occupied++;
+      if (++z == dim.Z) {
+        z = 0;
+        ++y;
+      }
+    }
+  }
+}
+
+// Keep only the labels that are referenced by the first or the current
+// layer. Every domain gets a single root label of the same size. The other
+// domains are finished and go into the statistics.
+void StreamingGrid::compact_forest()
+{
+  relabel.assign(forest.count(), 0);
+  compacted.clear();
+  auto compact = [&](vector<label_t> &labels) {
+    for (auto &l : labels) {
+      if (l == 0) continue;
+      size_t r = forest.find(l);
+      if (relabel[r] == 0) relabel[r] = compacted.make_set(forest.size(r));
+      l = relabel[r];
+    }
+  };
+  compact(first);
+  compact(cur);
+  for (size_t l = 1; l < forest.count(); ++l)
+    if (relabel[l] == 0 && forest.size(l) > 0 && forest.root(l) == l) {
+      stats.add(forest.size(l));
+      spins.add(forest.size(l));
+    }
+  swap(forest, compacted);
+}
+
+template<class Lattice>
+void StreamingGrid::run()
+{
+  size_t n = dim.Y*dim.Z;
+  first.assign(n, 0);
+  prev.assign(n, 0);
+  cur.assign(n, 0);
+  forest.clear();
+  occupied = 0;
+  domain_count = 0;
+  largest_domain = 0;
+  stats.clear();
+  spins.reset(seed, stream, realizations);
+
+  for (size_t x = 0; x < dim.X; ++x) {
+    load_layer(x);
+    label_layer<Lattice>(x);
+    if (x == 0) first = cur;
+    compact_forest();
+    swap(prev, cur);
+  }
+
+  // Merge the periodic bonds from the last layer, now in prev, to the first
+  for (size_t j = 0; j < n; ++j) {
+    if (prev[j] == 0) continue;
+    size_t y = j / dim.Z, z = j % dim.Z;
+    const Offset *s = Lattice::stencil(y);
+    for (int k = 0; k < Lattice::NUM_NEIGHBORS; ++k) {
+      if (s[k].dx <= 0) continue;
+      size_t l = first[wrap(y, s[k].dy, dim.Y)*dim.Z + wrap(z, s[k].dz, dim.Z)];
+      if (l == 0 || forest.find(l) == forest.find(prev[j])) continue;
+      size_t r = forest.unite(l, prev[j]);
+      domain_count--;
+      largest_domain = max<size_t>(largest_domain, forest.size(r));
+    }
+  }
+  for (size_t l = 1; l < forest.count(); ++l) {
+    if (forest.size(l) > 0 && forest.root(l) == l) {
+      stats.add(forest.size(l));
+      spins.add(forest.size(l));
+    }
+  }
+  spins.finish();
+}
+
+void StreamingGrid::run()
+{
+  switch(grid_type) {
+  case Grid::GRID_HEX:
+    run<LatticeHex>();
+    break;
+  case Grid::GRID_SC:
+  default:
+    run<LatticeSC>();
+    break;
+  }
+}
+
+size_t StreamingGrid::memory_usage() const
+{
+  return layer.num_words()*sizeof(BitLattice::Word)
+    + (first.capacity() + prev.capacity() + cur.capacity() + relabel.capacity())*sizeof(label_t)
+    + forest.memory_usage() + compacted.memory_usage();
+}
@@ -0,0 +1,94 @@
+#ifndef STREAMING_H
+#define STREAMING_H
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#include "bitlattice.h"
+#include "clusterstats.h"
+#include "grid.h"
+#include "magnetization.h"
+#include "unionfind.h"
+
+
+// Hoshen-Kopelman labeling that streams the lattice one x-layer at a time,
+// for lattices that do not fit into memory. Only the labels of the current
+// and the previous layer are kept, together with the first layer for the
+// periodic bond between the last and the first layer. After every layer
+// the forest is compacted to the labels that are still referenced, so the
+// memory is proportional to Y*Z instead of X*Y*Z.
+//
+// The occupancy is either read from a memory-mapped file or generated on the
+// fly: cell i is a defect with probability P, decided by the Philox value of
+// site i in the stream (seed, stream). Unlike Grid::build(), the number of
+// defects is therefore binomially distributed.
+class StreamingGrid
+{
+public:
+  StreamingGrid(Grid::Dimensions dim, Grid::GridType grid_type=Grid::GRID_SC);
+  ~StreamingGrid();
+
+  // Generate the occupancy from the random stream (seed, stream).
+  void generate(double P, uint64_t seed, uint64_t stream);
+  // Read the occupancy from a file with one bit per cell in linear cell
+  // order, packed like the words of a BitLattice, starting at byte offset.
+  // Returns false if the file cannot be mapped or is too small.
+  bool map_file(const std::string &path, size_t offset = 0);
+
+  // Number of random spin assignments to the domains that run() sums up
+  // for net_spins(), 0 by default
+  void set_spin_realizations(size_t val) { realizations = val; }
+  // Label the lattice and compute the domain statistics.
+  void run();
+
+  const Grid::Dimensions& dimensions() const { return dim; }
+  size_t num_occupied() const { return occupied; }
+  double density() const { return (double)occupied / (double)dim.volume(); }
+  size_t num_domains() const { return domain_count; }
+  size_t max_domain_len() const { return largest_domain; }
+  double avg_domain_len() const { return (double)occupied / (double)domain_count; }
+  size_t second_domain_len() const { return stats.second_largest(); }
+  // Statistics of the domain sizes. The domains are added as they are
+  // finished, so every query is O(1).
+  const ClusterStats& cluster_stats() const { return stats; }
+  // Net spin of every realization, summed up like the statistics as the
+  // domains are finished (see SpinSums)
+  const std::vector<int64_t>& net_spins() const { return spins.net_spins(); }
+  // Bytes allocated for the labeling, independent of X
+  size_t memory_usage() const;
+
+private:
+  typedef BasicUnionFind<label_t, uint64_t> Forest;
+
+  void unmap();
+  void load_layer(size_t x);
+  template<class Lattice> void run();
+  template<class Lattice> void label_layer(size_t x);
+  void compact_forest();
+
+  Grid::Dimensions dim;
+  Grid::GridType grid_type;
+
+  // Occupancy source
+  double P = 0.0;
+  uint64_t seed = 0;
+  uint64_t stream = 0;
+  const unsigned char *mapped = nullptr;
+  size_t mapped_bytes = 0;
+  size_t mapped_offset = 0;
+
+  BitLattice layer;
+  std::vector<label_t> first, prev, cur;
+  Forest forest, compacted;
+  std::vector<label_t> relabel;
+
+  size_t occupied = 0;
+  size_t domain_count = 0;
+  size_t largest_domain = 0;
+  ClusterStats stats;
+  size_t realizations = 0;
+  SpinSums spins;
+};
+
+#endif
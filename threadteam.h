@@ -0,0 +1,84 @@
+#ifndef THREADTEAM_H
+#define THREADTEAM_H
+
+#include <condition_variable>
+#include <cstddef>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+
+// Persistent threads for the fork-join loops of a single grid. run(n, f)
+// calls f(0), ..., f(n-1), f(0) on the calling thread and the others on
+// the team, and returns when all calls have finished. The threads are started
+// the first time a loop needs them and then wait for the next loop, so the
+// loops of repeated builds neither start threads nor allocate.
+class ThreadTeam
+{
+public:
+  ThreadTeam() = default;
+  ~ThreadTeam() {
+    {
+      std::lock_guard<std::mutex> lock(m);
+      stop = true;
+    }
+    start.notify_all();
+    for (auto &t : threads) t.join();
+  }
+  ThreadTeam(const ThreadTeam&) = delete;
+  ThreadTeam& operator=(const ThreadTeam&) = delete;
+
+  size_t size() const { return threads.size(); }
+
+  template<typename F>
+  void run(size_t n, F f) {
+    if (n <= 1) {
+      if (n == 1) f(0);
+      return;
+    }
+    while (threads.size() < n - 1) threads.emplace_back(&ThreadTeam::work, this);
+    {
+      std::lock_guard<std::mutex> lock(m);
+      fn = [](void *ctx, size_t k) { (*static_cast<F*>(ctx))(k); };
+      ctx = &f;
+      next = 1;
+      end = n;
+      remaining = n - 1;
+      generation++;
+    }
+    start.notify_all();
+    f(0);
+    std::unique_lock<std::mutex> lock(m);
+    done.wait(lock, [this] { return remaining == 0; });
+  }
+
+private:
+  // Take the indices of the current loop until none are left
+  void work() {
+    size_t seen = 0;
+    std::unique_lock<std::mutex> lock(m);
+    while (true) {
+      start.wait(lock, [&] { return stop || generation != seen; });
+      if (stop) return;
+      seen = generation;
+      while (next < end) {
+        size_t k = next++;
+        lock.unlock();
+        fn(ctx, k);
+        lock.lock();
+        if (--remaining == 0) done.notify_one();
+      }
+    }
+  }
+
+  std::vector<std::thread> threads;
+  std::mutex m;
+  std::condition_variable start, done;
+  void (*fn)(void*, size_t) = nullptr;
+  void *ctx = nullptr;
+  size_t next = 0, end = 0, remaining = 0;
+  size_t generation = 0;
+  bool stop = false;
+};
+
+#endif
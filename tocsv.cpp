@@ -0,0 +1,63 @@
+#include <iostream>
+#include <set>
+#include <string>
+
+#include "columnar.h"
+
+using namespace std;
+
+// Convert one table of a columnar output file of sim to CSV.
+
+void print_usage(const char *progname)
+{
+  cerr << "Usage: " << progname << " FILE [TABLE]" << endl;
+  cerr << "  FILE: Output of sim --output" << endl;
+  cerr << "  TABLE: Table to convert (default: the first table in FILE)" << endl;
+  cerr << "         Without a matching table, the tables in FILE are listed" << endl;
+}
+
+int main(int argc, char **argv)
+{
+  if (argc < 2) {
+    print_usage(argv[0]);
+    return 1;
+  }
+  columnar::Reader reader(argv[1]);
+  if (!reader.is_open()) {
+    cerr << "Error: " << argv[1] << " is not a columnar output file" << endl;
+    return 1;
+  }
+  string table = argc > 2 ? argv[2] : "";
+
+  cout.precision(17);
+  columnar::Chunk chunk;
+  set<string> tables;
+  bool header = false;
+  while (reader.next(chunk)) {
+    tables.insert(chunk.table);
+    if (table.empty()) table = chunk.table;
+    if (chunk.table != table) continue;
+    if (!header) {
+      for (size_t j = 0; j < chunk.columns.size(); ++j)
+        cout << (j ? "," : "") << chunk.columns[j].name;
+      cout << '\n';
+      header = true;
+    }
+    for (size_t i = 0; i < chunk.num_rows; ++i) {
+      for (size_t j = 0; j < chunk.columns.size(); ++j) {
+        if (j) cout << ',';
+        if (chunk.columns[j].type == columnar::UINT64) cout << chunk.data[j][i].u;
+        else cout << chunk.data[j][i].f;
+      }
+      cout << '\n';
+    }
+  }
+
+  if (!header) {
+    cerr << "Error: No table " << table << " in " << argv[1] << ". Tables:";
+    for (auto &t : tables) cerr << " " << t;
+    cerr << endl;
+    return 1;
+  }
+  return 0;
+}
@@ -0,0 +1,197 @@
+#ifndef UNIONFIND_H
+#define UNIONFIND_H
+
+#include <cstddef>
+#include <cstdint>
+#include <utility>
+#include <vector>
+
+// Domain label of a cell. 32-bit labels halve the label memory, but limit
+// the lattice to 2^32-1 cells, since every cell can get its own label.
+// Define GRID_WIDE_LABELS for larger lattices.
+#ifdef GRID_WIDE_LABELS
+typedef uint64_t label_t;
+#else
+typedef uint32_t label_t;
+#endif
+
+// Disjoint-set forest over domain labels with path compression and union by
+// size. Label 0 is reserved for empty cells and is always present as a dummy
+// entry, so real labels start at 1. Labels and sizes are stored as Label and
+// Size.
+template<typename Label, typename Size>
+class BasicUnionFind
+{
+public:
+  BasicUnionFind() { clear(); }
+
+  // Remove all labels. The storage is kept for the next labeling pass.
+  void clear() {
+    parent.assign(1, 0);
+    sizes.assign(1, 0);
+  }
+  // Make sure that all labels < n exist. New labels are roots of size 0.
+  void grow(size_t n) {
+    for (size_t l = parent.size(); l < n; ++l) {
+      parent.push_back(l);
+      sizes.push_back(0);
+    }
+  }
+  void reserve(size_t n) {
+    parent.reserve(n);
+    sizes.reserve(n);
+  }
+  void shrink_to_fit() {
+    parent.shrink_to_fit();
+    sizes.shrink_to_fit();
+  }
+  size_t make_set(size_t size = 1) {
+    parent.push_back(parent.size());
+    sizes.push_back(size);
+    return parent.size() - 1;
+  }
+
+  // Append all labels of other, shifted by count()-1 so that its label 1
+  // follows the last label of this forest. Returns the shift.
+  size_t append(const BasicUnionFind &other) {
+    size_t offset = parent.size() - 1;
+    for (size_t l = 1; l < other.parent.size(); ++l) {
+      parent.push_back(other.parent[l] + offset);
+      sizes.push_back(other.sizes[l]);
+    }
+    return offset;
+  }
+
+  size_t find(size_t l) {
+    size_t r = l;
+    while (parent[r] != r) r = parent[r];
+    while (parent[l] != r) {
+      size_t next = parent[l];
+      parent[l] = r;
+      l = next;
+    }
+    return r;
+  }
+  // Same as find(), but without compressing the path.
+  size_t root(size_t l) const {
+    while (parent[l] != l) l = parent[l];
+    return l;
+  }
+  // Merge the sets of a and b and return the new root. The root of the
+  // bigger set is kept.
+  size_t unite(size_t a, size_t b) {
+    a = find(a);
+    b = find(b);
+    if (a == b) return a;
+    if (sizes[a] < sizes[b]) std::swap(a, b);
+    parent[b] = a;
+    sizes[a] += sizes[b];
+    sizes[b] = 0;
+    return a;
+  }
+
+  size_t count() const { return parent.size(); }
+  // Labels that fit without reallocating
+  size_t capacity() const { return parent.capacity(); }
+  Size size(size_t root) const { return sizes[root]; }
+  Size& size(size_t root) { return sizes[root]; }
+  // Allocated bytes
+  size_t memory_usage() const {
+    return parent.capacity()*sizeof(Label) + sizes.capacity()*sizeof(Size);
+  }
+
+  // Raw parent and size arrays of all count() labels, e.g. for snapshots
+  const Label* parent_data() const { return parent.data(); }
+  const Size* size_data() const { return sizes.data(); }
+  void assign(const Label *parents, const Size *sizes, size_t n) {
+    parent.assign(parents, parents + n);
+    this->sizes.assign(sizes, sizes + n);
+  }
+
+private:
+  std::vector<Label> parent;
+  std::vector<Size> sizes;
+};
+
+// Forest of the Grid labels. The sizes fit into a label_t as well, since a
+// domain cannot have more cells than there are labels.
+typedef BasicUnionFind<label_t, label_t> UnionFind;
+
+// Disjoint-set forest over the domains of a labeling with open boundaries,
+// which are joined by the bonds across the periodic boundaries. Every label
+// stores its shift relative to its parent: the number of periods by which
+// its cells are moved in x, y and z when the joined domain is unwrapped. A
+// bond that closes a loop with a non-zero total shift winds around the
+// lattice (Machta et al.).
+template<typename Label>
+class BasicWindingForest
+{
+public:
+  struct Shift
+  {
+    int32_t d[3];
+  };
+
+  // Labels 0..n-1, all roots
+  void reset(size_t n) {
+    parent.resize(n);
+    shifts.assign(n, Shift{{0, 0, 0}});
+    for (size_t l = 0; l < n; ++l) parent[l] = l;
+  }
+  // Make p the parent of l without a shift, e.g. for the labels of one
+  // open domain
+  void link(size_t l, size_t p) { parent[l] = p; }
+
+  // Root of l. shift is set to the shift of l relative to the root.
+  size_t find(size_t l, Shift &shift) {
+    size_t r = l;
+    Shift total{{0, 0, 0}};
+    while (parent[r] != r) {
+      add(total, shifts[r], 1);
+      r = parent[r];
+    }
+    shift = total;
+    while (parent[l] != r && parent[l] != l) {
+      size_t next = parent[l];
+      Shift rel = shifts[l];
+      parent[l] = r;
+      shifts[l] = total;
+      add(total, rel, -1);
+      l = next;
+    }
+    return r;
+  }
+  // Join a and b by a bond that moves b by w periods relative to a. Returns
+  // the axes (bit d for axis d) that the bond makes the domain wind around.
+  unsigned unite(size_t a, size_t b, const Shift &w) {
+    Shift sa, sb;
+    size_t ra = find(a, sa), rb = find(b, sb);
+    add(sa, w, 1);
+    add(sa, sb, -1);
+    if (ra != rb) {
+      parent[rb] = ra;
+      shifts[rb] = sa;
+      return 0;
+    }
+    unsigned axes = 0;
+    for (int d = 0; d < 3; ++d)
+      if (sa.d[d] != 0) axes |= 1u << d;
+    return axes;
+  }
+
+  size_t memory_usage() const {
+    return parent.capacity()*sizeof(Label) + shifts.capacity()*sizeof(Shift);
+  }
+
+private:
+  static void add(Shift &a, const Shift &b, int sign) {
+    for (int d = 0; d < 3; ++d) a.d[d] += sign*b.d[d];
+  }
+
+  std::vector<Label> parent;
+  std::vector<Shift> shifts;
+};
+
+typedef BasicWindingForest<label_t> WindingForest;
+
+#endif
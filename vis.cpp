@@ -1,4 +1,5 @@
 #include <cassert>
+#include <cmath>
 #include <cstring>
 #include <functional>
 #include <fstream>
@@ -7,6 +8,7 @@
 #include <random>
 #include <set>
 #include <string>
+#include <thread>
 #include <vector>
 
 using namespace std;
@@ -19,6 +21,7 @@ static const bool INFO = false;
 
 #include "grid.h"
 #include "graphics.h"
+#include "snapshot.h"
 
 struct SimulationParams
 {
@@ -29,14 +32,27 @@ struct SimulationParams
   Grid::GridType grid_type;
 };
 
-void vis(SimulationParams params, const string &base_path, size_t img_width, size_t img_height)
+// With a checkpoint path, the grid is saved after every frame and a run
+// resumes from the saved grid if the checkpoint exists.
+void vis(SimulationParams params, const string &base_path, size_t img_width, size_t img_height,
+         const string &checkpoint)
 {
   double step = 1.0/(double)params.Psteps;
   double P = 0.0;
   Grid grid(P, {params.L, params.L, params.T}, params.grid_type);
-  grid.build();
+  grid.set_threads(thread::hardware_concurrency());
 
   int counter = 0;
+  Snapshot snapshot;
+  if (!checkpoint.empty() && snapshot.open(checkpoint) && snapshot.restore(grid)) {
+    P = grid.density();
+    counter = (int)lround(P/step);
+    cerr << "Resuming at P = " << P << " (frame " << counter << ")" << endl;
+  } else {
+    grid.build();
+  }
+  snapshot.close();
+
   while(P <= 1.0) {
     Image frame;
     string filename(base_path + "_" + to_string(counter++) + ".png");
@@ -58,18 +74,23 @@ void vis(SimulationParams params, const string &base_path, size_t img_width, siz
 
     P += step;
     grid.update(P);
+    if (!checkpoint.empty() && !Snapshot::write(grid, checkpoint))
+      cerr << "Warning: Could not write checkpoint " << checkpoint << endl;
   }
 }
 
 void print_usage(const char *progname)
 {
-  cerr << "Usage: " << progname << " L T P PROJ GRID PATH" << endl;
+  cerr << "Usage: " << progname << " [OPTIONS] L T P PROJ GRID PATH" << endl;
   cerr << "  L: Lateral grid dimension" << endl;
   cerr << "  T: Grid thickness (in z-direction)" << endl;
   cerr << "  P: Number of defect density steps between (0,1)" << endl;
   cerr << "  PROJ: One of \"grid\", \"domains\", \"spins\"" << endl;
-  cerr << "  GRID: One of \"sc\", \"hex\"" << endl;
+  cerr << "  GRID: One of \"sc\", \"hex\" (hex needs an even L)" << endl;
   cerr << "  PATH: Base path for output files" << endl;
+  cerr << "Options:" << endl;
+  cerr << "  --checkpoint FILE: Save the grid to FILE after every frame and resume" << endl;
+  cerr << "                     from it if it exists" << endl;
 }
 
 int main(int argc, char **argv)
@@ -78,6 +99,21 @@ int main(int argc, char **argv)
   SimulationParams params;
   params.projection_type = Grid::PROJECT_GRID;
   params.grid_type = Grid::GRID_SC;
+  string checkpoint;
+
+  vector<char*> args;
+  for (int i = 0; i < argc; ++i) {
+    string s(argv[i]);
+    if (s == "--checkpoint" && i+1 < argc) checkpoint = argv[++i];
+    else if (s.compare(0, 2, "--") == 0) {
+      cerr << "Error: Unknown option " << s << endl;
+      print_usage(argv[0]);
+      return 1;
+    }
+    else args.push_back(argv[i]);
+  }
+  argc = args.size();
+  argv = args.data();
 
   if (argc <= 3) {
     print_usage(argv[0]);
@@ -116,13 +152,17 @@ int main(int argc, char **argv)
       return 1;
     }
   }
+  if (!Grid::valid_dimensions({params.L, params.L, params.T}, params.grid_type)) {
+    cerr << "Error: A hex grid needs an even L!" << endl;
+    return 1;
+  }
 
   if (argc > 6)
     base_path = string(argv[6]);
 
   init_video_lib();
 
-  vis(params, base_path, img_width, img_height);
+  vis(params, base_path, img_width, img_height, checkpoint);
 
   return 0;
 }